@@ -34,10 +34,11 @@ SOFTWARE.
 
 #include <set>
 #include <unordered_map>
-#include <unordered_set>
 #include <sstream>
 #include <algorithm>
 #include <array>
+#include <thread>
+#include <condition_variable>
 
 #include <stb_truetype.h>
 #include <pangolin/pangolin.h>
@@ -54,6 +55,259 @@ struct Sample
   T t,x;
   };
 
+// Gorilla style sample stream: first sample raw (16 bytes), then per sample, msb first
+//   t: delta of delta of the double bit patterns  '0' | '10'+7 | '110'+9 | '1110'+12 | '1111'+64 bits
+//   x: xor with the previous value  '0' same | '10'+bits in the previous window | '11'+5 lead+6 length(0=64)+bits
+// regularly sampled smooth data costs a few bits per sample instead of 16 bytes
+struct GorillaDecoder
+  {
+  const unsigned char* p;
+  uint64_t pos=0;
+  
+  uint64_t t,x;
+  int64_t delta=0;
+  int lead=0,len=64;
+  
+  GorillaDecoder(const unsigned char* a) : p(a+16) { memcpy(&t,a,8); memcpy(&x,a+8,8); }
+  
+  uint64_t bits(int n)
+    {
+    uint64_t r=0;
+    while(n)
+      {
+      int avail=8-(pos&7);
+      int take=std::min(n,avail);
+      r=(r<<take)|((p[pos>>3]>>(avail-take))&((1u<<take)-1));
+      pos+=take;
+      n-=take;
+      }
+    return r;
+    }
+  
+  int64_t sbits(int n) { return (int64_t)(bits(n)<<(64-n))>>(64-n); }
+  
+  void next()
+    {
+    if(bits(1))
+      {
+           if(!bits(1))delta+=sbits(7);
+      else if(!bits(1))delta+=sbits(9);
+      else if(!bits(1))delta+=sbits(12);
+      else delta+=(int64_t)bits(64);
+      }
+    t+=(uint64_t)delta;
+    
+    if(bits(1))
+      {
+      if(bits(1)){lead=bits(5);len=bits(6);if(len==0)len=64;if(lead+len>64)len=64-lead;}
+      x^=bits(len)<<(64-lead-len);
+      }
+    }
+  
+  Sample sample() const
+    {
+    Sample s;
+    memcpy(&s.t,&t,8);
+    memcpy(&s.x,&x,8);
+    return s;
+    }
+  };
+
+// opcode 8 table entry, offset and count are in samples from the end of the table
+struct BatchEntry
+  {
+  enum { clear=1, newsegment=2 };
+  int32_t handle,flags,offset,count;
+  };
+
+// append-only storage in fixed size blocks, growing never moves more than one block.
+// The directory is a plain vector so the store (and whatever holds it) moves without throwing
+// and a vector of segments reallocates by moving, never by copying their blocks.
+template<typename T, int LOG2=16>
+struct BlockStore
+  {
+  static constexpr size_t block=size_t(1)<<LOG2;
+  static constexpr size_t mask=block-1;
+  
+  std::vector < std::vector < T > > blocks;
+  size_t head=0;  // blocks before it are released, the directory is compacted now and then
+  size_t count=0;
+  size_t first=0; // slots already dropped from the front block
+  
+  size_t size() const { return count; }
+  bool empty() const { return count==0; }
+  T& operator[](size_t a) { a+=first; return blocks[head+(a>>LOG2)][a&mask]; }
+  const T& operator[](size_t a) const { a+=first; return blocks[head+(a>>LOG2)][a&mask]; }
+  T& back() { return (*this)[count-1]; }
+  
+  // up to n contiguous slots at the end, n is cut to what fits in the tail block
+  T* extend(size_t& n)
+    {
+    if(blocks.size()==head || blocks.back().size()==block)blocks.emplace_back();
+    auto& b=blocks.back();
+    n=std::min(n,block-b.size());
+    if(b.capacity()<b.size()+n)b.reserve(std::min(block,std::max(b.size()+n,b.capacity()*2)));
+    b.resize(b.size()+n);
+    count+=n;
+    return b.data()+b.size()-n;
+    }
+  
+  // drops the last n slots of the tail block
+  void shrink(size_t n) { blocks.back().resize(blocks.back().size()-n); count-=n; }
+  
+  // keeps the first n slots
+  void truncate(size_t n)
+    {
+    if(n>=count)return;
+    if(n==0){clear();return;}
+    size_t t=first+n;
+    blocks.resize(head+((t+block-1)>>LOG2));
+    blocks.back().resize(t-((blocks.size()-head-1)<<LOG2));
+    count=n;
+    }
+  
+  void push_back(const T& a) { size_t n=1; *extend(n)=a; }
+  void append(const T* a,size_t num)
+    {
+    while(num)
+      {
+      size_t n=num;
+      std::copy(a,a+n,extend(n));
+      a+=n;num-=n;
+      }
+    }
+  void clear() { blocks.clear(); head=0; count=0; first=0; }
+  
+  // forgets the oldest n slots, whole blocks are released as soon as they are passed
+  void drop_front(size_t n)
+    {
+    n=std::min(n,count);
+    first+=n;
+    count-=n;
+    while(first>=block){std::vector<T>().swap(blocks[head++]);first-=block;}
+    if(count==0){clear();return;}
+    if(head>=16 && 2*head>=blocks.size()){blocks.erase(blocks.begin(),blocks.begin()+head);head=0;}
+    }
+  };
+
+// min/max summary of a segment, node k of level L covers samples [k<<(base+L),(k+1)<<(base+L))
+// counted from the first sample the segment ever had, only complete nodes are kept
+struct MinMaxPyramid
+  {
+  static constexpr int base=4;
+  struct Node { double mn,mx; int32_t imn,imx; }; // imn,imx relative to the node start
+  
+  std::vector < BlockStore < Node, 12 > > levels;
+  std::vector < size_t > first; // index of the first node kept on each level
+  
+  static size_t nodesize(int level) { return size_t(1)<<(base+level); }
+  int numlevels() const { return (int)levels.size(); }
+  size_t end(int level) const { return first[level]+levels[level].size(); }
+  const Node& node(int level,size_t k) const { return levels[level][k-first[level]]; }
+  void clear() { levels.clear(); first.clear(); }
+  
+  // forgets the nodes made only of samples before a
+  void drop_before(size_t a)
+    {
+    for(int L=0;L<numlevels();L++)
+      {
+      size_t k=a/nodesize(L);
+      if(k<=first[L])continue;
+      levels[L].drop_front(k-first[L]);
+      first[L]=k;
+      }
+    }
+  
+  // forgets the nodes holding sample a or anything after it
+  void truncate_from(size_t a)
+    {
+    for(int L=0;L<numlevels();L++)levels[L].truncate(std::max(a/nodesize(L),first[L])-first[L]);
+    }
+  
+  static Node combine(const Node& a,const Node& b,int32_t half)
+    {
+    Node e=a;
+    if(b.mn<e.mn){e.mn=b.mn;e.imn=b.imn+half;}
+    if(b.mx>e.mx){e.mx=b.mx;e.imx=b.imx+half;}
+    return e;
+    }
+  };
+
+// how a channel's vertices are drawn, runs of segments with the same style and sizes go out in one
+// batch whatever their colours, which travel with the vertices
+struct DrawState
+  {
+  int style=-1;
+  double r=1,g=1,b=1,a=1,alpha=1,linewidth=1,pointsize=1;
+  bool batches_with(const DrawState& o) const
+    {
+    return style==o.style && linewidth==o.linewidth && pointsize==o.pointsize && lines()==o.lines();
+    }
+  bool lines() const { return style!=2 && (style==0||alpha!=0); }
+  };
+
+// a batched vertex, t,x and the colours its line strip and its points or bars are drawn in
+struct BatchVertex
+  {
+  float t,x;
+  uint8_t line[4],fill[4];
+  };
+
+// VBOs owned by segments through handles. A slot's generation moves on when it is released, so a
+// handle that outlived its segment can never reach the buffer of the slot's next owner.
+struct BufferPool
+  {
+  struct Handle { int slot=-1; uint32_t gen=0; };
+  
+  std::vector < std::unique_ptr < pangolin::GlBuffer > > bufs;
+  std::vector < uint32_t > gens;
+  std::vector < int > freed;
+  
+  bool owns(const Handle& h) const { return h.slot>=0 && gens[h.slot]==h.gen; }
+  
+  pangolin::GlBuffer& get(Handle& h)
+    {
+    if(owns(h))return *bufs[h.slot];
+    if(freed.empty()){freed.push_back(bufs.size());bufs.emplace_back();gens.push_back(0);}
+    h.slot=freed.back();
+    h.gen=gens[h.slot];
+    freed.pop_back();
+    bufs[h.slot]=std::make_unique<pangolin::GlBuffer>(pangolin::GlArrayBuffer,0,GL_FLOAT,2,GL_DYNAMIC_DRAW);
+    return *bufs[h.slot];
+    }
+  
+  void release(Handle& h)
+    {
+    if(owns(h)){bufs[h.slot].reset();gens[h.slot]++;freed.push_back(h.slot);}
+    h={};
+    }
+  };
+
+// pixel unpack buffer owned by its holder and deleted with it, the storage only ever grows
+struct GlUnpackBuffer
+  {
+  GLuint id=0;
+  size_t size=0;
+  
+  GlUnpackBuffer()=default;
+  GlUnpackBuffer(GlUnpackBuffer&& o) noexcept : id(o.id),size(o.size) { o.id=0; o.size=0; }
+  GlUnpackBuffer& operator=(GlUnpackBuffer&& o) noexcept { std::swap(id,o.id); std::swap(size,o.size); return *this; }
+  ~GlUnpackBuffer() { if(id)glDeleteBuffers(1,&id); }
+  
+  // leaves the buffer bound to GL_PIXEL_UNPACK_BUFFER holding bytes of p from offset 0
+  void stage(const void* p,size_t bytes)
+    {
+    if(!id)glGenBuffers(1,&id);
+    glBindBuffer(GL_PIXEL_UNPACK_BUFFER,id);
+    if(bytes>size)
+      {
+      size=std::max(bytes,2*size);
+      glBufferData(GL_PIXEL_UNPACK_BUFFER,size,nullptr,GL_STREAM_DRAW);
+      }
+    glBufferSubData(GL_PIXEL_UNPACK_BUFFER,0,bytes,p);
+    }
+  };
+
 struct OneVertex
   {
   struct { float x,y,z,w;} vertex;
@@ -192,30 +446,77 @@ struct ChanInfo
   int used=0;
   int showshadow=1;
   double samplesperpixel=10;
+  int decim=0; // 0 stride or pyramid envelope, 1 M4 per pixel column, 2 LTTB for point channels
   int wintab=1;
   
   struct Segment
     {
-    std::vector < Sample > data;
-    double vastart=sw_qnan();
-    
+    BlockStore < Sample > data;
+    double vastart=sw_qnan(); // time the VBO vertices are relative to, nan forces a rebuild
+    BufferPool::Handle vbo;   // moves with the segment, released when the segment is dropped
+    
+    // uniformly sampled run: only the values are kept, sample q1 is at t0+q1*dt
+    BlockStore < double > values;
+    double t0=0,dt=0;
+    bool uniform=false;
+    
+    int size() const { return uniform?(int)values.size():(int)data.size(); }
+    double time (int a) const { return uniform?t0+a*dt:data[a].t; }
+    double value(int a) const { return uniform?values[a]:data[a].x; }
+    bool continues(double t,double d) const { return uniform && d==dt && std::abs(t-time(size()))<dt*1e-3; }
+    void materialize();
+    size_t bytes() const { return size()*(uniform?sizeof(double):sizeof(Sample)); }
+    int before(double t);
+    void evict(size_t n);
     
     double get_data_at_time(double t);
     int lefttime (double t);
     int righttime(double t);
     void findtime(double lt, double rt, double samplespp, double width);
     
+    MinMaxPyramid pyr;
+    size_t evicted=0; // samples dropped from the front, the pyramid counts them
+    void update_pyramid();
+    void invalidate_from(int a) { pyr.truncate_from(evicted+a); lttb_key={}; rkey={}; }
+    MinMaxPyramid::Node minmax(int a,int b);
+    bool visible_minmax(double& mn,double& mx);
+    void history_minmax(double& mn,double& mx);
+    
+    // extent of every sample still held, kept by update_pyramid
+    double hmin=1e300,hmax=-1e300;
+    size_t hend=0;
+    
+    // size and bytes already counted into the channel totals
+    size_t held_n=0,held_b=0;
+    void m4(double lt, double rt, double width);
+    void envelope(double lt, double rt, double width);
+    void lttb(int budget);
+    void build_view(double starttime);
+    
     //runtime
     ChanInfo* parent;
     int c1,c2;
     int toprint,stride;
+    int level; // pyramid level drawn between c1 and c2, -1 draws every stride-th sample, -2 draws picks,
+               // -3 draws one bar per pair of picks
+    bool vwhole=false;        // the VBO holds every sample from vfirst on, not a decimated view
+    size_t vfirst=0,vcount=0; // counted like the pyramid
+    std::array<size_t,4> vkey{}; // view the decimated vertices were built for
+    std::vector<float> vcache;   // decimated vertices, streamed every frame they are drawn
+    std::vector<int> picks;
+    std::array<size_t,2> rkey{}; // c1,c2+1 from the first sample ever that rmin,rmax were found for
+    double rmin,rmax;
+    std::array<size_t,3> lttb_key{}; // c1,c2 from the first sample ever and the budget picks were made for
     double alpha;
     };
   
+  // columns of h RGB pixels, each contiguous in data. The textures are transposed (h wide,
+  // maxtexture tall) so a run of new columns is a run of texture rows and goes up in one call.
   struct ImageData
     {
     std::vector<float> data;
     std::vector<pangolin::GlTexture> tex;
+    GlUnpackBuffer pbo; // new columns are staged in it
     int totalfill=0;
     
     int maxtexture=4096;
@@ -242,10 +543,18 @@ struct ChanInfo
     };
   
   std::vector<Segment> data;
+  static_assert(std::is_nothrow_move_constructible<Segment>::value,"data must grow by moving segments");
   ImageData data2;
   
+  // opcode 3 samples waiting to be appended to the last segment
+  std::vector<Sample> pending;
+  
   struct {double r=1,g=1,b=1,a=1,width=1;int style=0;} style;
   
+  // retention, 0 means unlimited, samples older than lasttime-age are dropped
+  struct Retention {double samples=0,age=0,bytes=0;} keep;
+  size_t held_n=0,held_b=0; // samples and bytes of all segments, kept by account()
+  
   std::string name,dname,label;
   
   int displayname=1;
@@ -294,8 +603,13 @@ struct FrameInfo
   
   double lasttime,firsttime;
   
+  // extent of the samples of the active channels, widened on append, rescanned when dirty
+  double ext_first=1e100,ext_last=-1e100;
+  bool ext_dirty=true;
+  
+  ChanInfo::Retention keep; // default for channels without their own limits
+  
   std::vector < OneVertex > pts;
-  pangolin::GlBuffer vbo;
   
   //mouse
   struct {double x,y; int inside;}mouse;
@@ -336,7 +650,6 @@ struct WindowInfo
   std::set<int> channels;
   
   std::vector < OneVertex > pts;
-  pangolin::GlBuffer vbo;
   
   //mouse
   struct {double x,y; int inside;} mouse;
@@ -348,6 +661,15 @@ struct WindowInfo
   int reconfigured=1;
   int curtab=1;
   
+  // density mode: line and point channels are counted into hits (hh rows per pixel column,
+  // one count per channel and pixel it passes) and shown as one texture through a colour ramp
+  int density=0;
+  int hw=0,hh=0;
+  std::vector < uint32_t > hits;
+  std::vector < uint32_t > bandmax;
+  std::vector < uint8_t > heatpx; // RGBA, row major
+  pangolin::GlTexture heat;
+  
   FrameInfo*fr=nullptr;
   
   };
@@ -365,20 +687,208 @@ struct svector
   auto end(){return data.end();}
   };
 
+// single producer / single consumer ring, producer only touches tail, consumer only head
+template<typename T, int LOG2=10>
+struct spsc_queue
+  {
+  static constexpr size_t capacity=size_t(1)<<LOG2;
+  static constexpr size_t mask=capacity-1;
+
+  std::vector < T > slots=std::vector<T>(capacity);
+  alignas(64) std::atomic<size_t> head{0};
+  alignas(64) std::atomic<size_t> tail{0};
+
+  // moves out of a only on success
+  bool push(T& a)
+    {
+    size_t t=tail.load(std::memory_order_relaxed);
+    if(t-head.load(std::memory_order_acquire)==capacity)return false;
+    slots[t&mask]=std::move(a);
+    tail.store(t+1,std::memory_order_release);
+    return true;
+    }
+
+  T* front()
+    {
+    size_t h=head.load(std::memory_order_relaxed);
+    if(h==tail.load(std::memory_order_acquire))return nullptr;
+    return &slots[h&mask];
+    }
+
+  void pop() { head.store(head.load(std::memory_order_relaxed)+1,std::memory_order_release); }
+  };
+
+// fixed set of threads running the indices of one job at a time, the caller takes part as well
+struct WorkerPool
+  {
+  std::vector < std::thread > threads;
+  std::mutex m;
+  std::condition_variable wake,done;
+  std::function<void(size_t)> job;
+  size_t jobsize=0;
+  std::atomic<size_t> next{0};
+  uint64_t generation=0;
+  int running=0;
+  bool quit=false;
+  
+  WorkerPool(int n=std::max(1u,std::thread::hardware_concurrency())-1)
+    {
+    for(int q1=0;q1<n;q1++)threads.emplace_back([this]{loop();});
+    }
+  
+  ~WorkerPool()
+    {
+    {std::lock_guard<std::mutex> lk(m);quit=true;}
+    wake.notify_all();
+    for(auto&t:threads)t.join();
+    }
+  
+  void work() { for(size_t q1;(q1=next++)<jobsize;)job(q1); }
+  
+  void loop()
+    {
+    uint64_t seen=0;
+    for(;;)
+      {
+      {
+      std::unique_lock<std::mutex> lk(m);
+      wake.wait(lk,[&]{return quit || generation!=seen;});
+      if(quit)return;
+      seen=generation;
+      }
+      work();
+      std::lock_guard<std::mutex> lk(m);
+      if(--running==0)done.notify_one();
+      }
+    }
+  
+  // f(0)..f(n-1), returns when all of them finished
+  void run(size_t n,std::function<void(size_t)> f)
+    {
+    if(n==0)return;
+    if(threads.empty() || n==1){for(size_t q1=0;q1<n;q1++)f(q1);return;}
+    {
+    std::lock_guard<std::mutex> lk(m);
+    job=std::move(f);
+    jobsize=n;
+    next=0;
+    running=threads.size();
+    generation++;
+    }
+    wake.notify_all();
+    work();
+    std::unique_lock<std::mutex> lk(m);
+    done.wait(lk,[&]{return running==0;});
+    }
+  };
+
+// one GL buffer split into per frame regions for geometry that is rewritten every frame,
+// a fence per region keeps the CPU from overwriting what the GPU may still be reading.
+// The buffer stays mapped (persistent, coherent) so a push is only a memcpy.
+struct StreamRing
+  {
+  static constexpr int regions=3;
+  
+  GLuint bo=0;
+  char* ptr=nullptr; // all regions of bo
+  size_t region_size=1<<20;
+  size_t used=0;
+  int cur=0;
+  GLsync fence[regions]={};
+  
+  void begin_frame()
+    {
+    if(!bo)allocate();
+    if(fence[cur]){glClientWaitSync(fence[cur],GL_SYNC_FLUSH_COMMANDS_BIT,1000000000);glDeleteSync(fence[cur]);fence[cur]=0;}
+    used=0;
+    }
+  
+  void end_frame()
+    {
+    fence[cur]=glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE,0);
+    cur=(cur+1)%regions;
+    }
+  
+  // copies bytes into this frame's region, returns their offset in bo
+  GLintptr push(const void* p,size_t bytes)
+    {
+    used=(used+15)&~size_t(15);
+    if(used+bytes>region_size)
+      {
+      while(bytes>region_size/2)region_size*=2;
+      region_size*=2;
+      allocate();
+      }
+    GLintptr off=cur*region_size+used;
+    used+=bytes;
+    if(bytes)std::memcpy(ptr+off,p,bytes);
+    return off;
+    }
+  
+  // fresh storage, draws already issued keep the deleted one alive so no fence is needed any more
+  void allocate()
+    {
+    if(bo)glDeleteBuffers(1,&bo);
+    glGenBuffers(1,&bo);
+    glBindBuffer(GL_ARRAY_BUFFER,bo);
+    GLbitfield flags=GL_MAP_WRITE_BIT|GL_MAP_PERSISTENT_BIT|GL_MAP_COHERENT_BIT;
+    glBufferStorage(GL_ARRAY_BUFFER,regions*region_size,nullptr,flags);
+    ptr=(char*)glMapBufferRange(GL_ARRAY_BUFFER,0,regions*region_size,flags);
+    glBindBuffer(GL_ARRAY_BUFFER,0);
+    for(auto&f:fence)if(f){glDeleteSync(f);f=0;}
+    used=0;
+    }
+  };
+
 ///////////////////////////////////////////////////////////////////////////////////////////////////////
 
 
 
+void ChanInfo::Segment::materialize()
+  {
+  if(!uniform)return;
+  for(size_t q1=0;q1<values.size();q1++)data.push_back({t0+q1*dt,values[q1]});
+  values.clear();
+  uniform=false;
+  }
+
+// number of samples strictly before t
+int ChanInfo::Segment::before(double t)
+  {
+  if(size()==0)return 0;
+  int l=lefttime(t);
+  return time(l)<t?l+1:0;
+  }
+
+void ChanInfo::Segment::evict(size_t n)
+  {
+  if(n==0)return;
+  n=std::min(n,(size_t)size());
+  if(uniform){values.drop_front(n);t0+=n*dt;}
+  else data.drop_front(n);
+  evicted+=n;
+  pyr.drop_before(evicted);
+  hend=0;
+  // picks are relative to the first kept sample, so a cached pick set is shifted now
+  lttb_key={};
+  }
+
 double ChanInfo::Segment::get_data_at_time(double t)
   {
-  int n=data.size();
+  int n=size();
   
-  if(data.size()==0)return sw_qnan(); 
-  if(data.size()==1)return sw_qnan();
+  if(n==0)return sw_qnan(); 
+  if(n==1)return sw_qnan();
   
   
-  if(t<data[0].t)return sw_qnan();
-  if(t>data[n-1].t)return sw_qnan();
+  if(t<time(0))return sw_qnan();
+  if(t>time(n-1))return sw_qnan();
+  
+  if(uniform)
+    {
+    int l=std::clamp((int)std::floor((t-t0)/dt),0,n-2);
+    return values[l]+(values[l+1]-values[l])*(t-time(l))/dt;
+    }
   
   int l,m,r;
   l=0;
@@ -401,6 +911,8 @@ double ChanInfo::Segment::get_data_at_time(double t)
 
 int ChanInfo::Segment::lefttime(double t)
   {
+  if(uniform)return std::clamp((int)std::ceil((t-t0)/dt)-1,0,std::max(0,size()-1));
+  
   int l,m,r;
   l=0;
   r=data.size()-1;
@@ -415,6 +927,8 @@ int ChanInfo::Segment::lefttime(double t)
 
 int ChanInfo::Segment::righttime(double t)
   {
+  if(uniform)return size()?std::clamp((int)std::floor((t-t0)/dt)+1,0,size()-1):-1;
+  
   int l,m,r;
   l=0;
   r=data.size()-1;
@@ -434,11 +948,299 @@ void ChanInfo::Segment::findtime(double lt, double rt, double samplespp, double
   c2=righttime(rt);
   //printf("%30s SIZE: %4d %10lf %10lf %4d %4d\n",parent->name.c_str(),(int)data.size(),lt,rt,c1,c2);
   toprint=(int)std::round(width*samplespp+0.5);
+  int budget=toprint;
   stride=(c2-c1+1)/toprint;
   if(stride==0)stride=1;
   toprint=(c2-c1+stride)/stride;
   //if(c2<c1)printf("Unsorted Data detected: (%s)  %d %d\n",parent->name.c_str(),c1,c2);
   alpha=0.3*pow(1-std::min(1.0,toprint/width*10),4);
+  
+  level=-1;
+  if(c2<c1)return;
+  if(parent->style.style==2)
+    {
+    // bars: every visible sample while they are sparse, one envelope per pixel column otherwise
+    stride=1;
+    toprint=c2-c1+1;
+    if(c2-c1+1>2*width)envelope(lt,rt,width);
+    return;
+    }
+  if(parent->decim==1 && c2-c1+1>4*width){m4(lt,rt,width);return;}
+  if(parent->decim==2 && parent->style.style==1 && budget>=3 && c2-c1+1>budget){lttb(budget);return;}
+  
+  // a node gives two vertices, so nodes of about two strides keep the vertex count
+  if(stride*2<(int)MinMaxPyramid::nodesize(0))return;
+  update_pyramid();
+  while(level+1<pyr.numlevels() && MinMaxPyramid::nodesize(level+1)<=(size_t)stride*2)level++;
+  if(level<0)return;
+  
+  size_t ns=MinMaxPyramid::nodesize(level);
+  size_t n1=(evicted+c1+ns-1)/ns;
+  size_t n2=(evicted+c2+1)/ns;
+  toprint=2+2*(n2>n1?n2-n1:0);
+  }
+
+// min and max of samples [a,b), imn and imx are segment indices, raw samples only at the unaligned ends
+MinMaxPyramid::Node ChanInfo::Segment::minmax(int a,int b)
+  {
+  static constexpr int base=MinMaxPyramid::base;
+  static constexpr size_t mask=(size_t(1)<<base)-1;
+  
+  MinMaxPyramid::Node e{value(a),value(a),a,a};
+  auto raw=[&](size_t q1)
+    {
+    double v=value(q1-evicted);
+    if(v<e.mn){e.mn=v;e.imn=q1-evicted;}
+    if(v>e.mx){e.mx=v;e.imx=q1-evicted;}
+    };
+  auto take=[&](int L,size_t k)
+    {
+    const auto& n=pyr.node(L,k);
+    int start=(k<<(base+L))-evicted;
+    if(n.mn<e.mn){e.mn=n.mn;e.imn=start+n.imn;}
+    if(n.mx>e.mx){e.mx=n.mx;e.imx=start+n.imx;}
+    };
+  
+  size_t lo=evicted+a,hi=evicted+b;
+  while(lo<hi && (lo&mask))raw(lo++);
+  while(lo<hi && (hi&mask))raw(--hi);
+  
+  size_t l=lo>>base,r=hi>>base;
+  for(int L=0;l<r;L++,l>>=1,r>>=1)
+    {
+    if(l&1)take(L,l++);
+    if(r&1)take(L,--r);
+    }
+  return e;
+  }
+
+void ChanInfo::Segment::history_minmax(double& mn,double& mx)
+  {
+  update_pyramid();
+  if(!size())return;
+  mn=std::min(mn,hmin);
+  mx=std::max(mx,hmax);
+  }
+
+// widens mn,mx by the samples c1..c2, exact and only recomputed when the range moves
+bool ChanInfo::Segment::visible_minmax(double& mn,double& mx)
+  {
+  if(c2<c1)return false;
+  std::array<size_t,2> key{evicted+c1,evicted+c2+1};
+  if(key!=rkey)
+    {
+    update_pyramid();
+    auto e=minmax(c1,c2+1);
+    rmin=e.mn;
+    rmax=e.mx;
+    rkey=key;
+    }
+  mn=std::min(mn,rmin);
+  mx=std::max(mx,rmax);
+  return true;
+  }
+
+// first, min, max and last sample of every pixel column between c1 and c2, in time order
+void ChanInfo::Segment::m4(double lt, double rt, double width)
+  {
+  update_pyramid();
+  level=-2;
+  lttb_key={};
+  picks.clear();
+  picks.push_back(c1);
+  
+  int columns=(int)std::ceil(width);
+  int a=c1+1;
+  for(int q1=1;q1<=columns && a<c2;q1++)
+    {
+    int b=q1==columns?c2:std::clamp(before(lt+(rt-lt)*q1/columns),a,c2);
+    if(b==a)continue;
+    
+    auto e=minmax(a,b);
+    int i1=std::min(e.imn,e.imx);
+    int i2=std::max(e.imn,e.imx);
+    for(int i:{a,i1,i2,b-1})if(i!=picks.back())picks.push_back(i);
+    a=b;
+    }
+  
+  if(c2!=picks.back())picks.push_back(c2);
+  toprint=picks.size();
+  }
+
+// column boundaries for bars, samples [picks[q1],picks[q1+1]) fall into one pixel column,
+// the last one ends at the sample after c2 since every sample's bar reaches to the next one
+void ChanInfo::Segment::envelope(double lt, double rt, double width)
+  {
+  update_pyramid();
+  level=-3;
+  lttb_key={};
+  picks.clear();
+  picks.push_back(c1);
+  
+  int e=std::min(c2+1,size()-1);
+  int columns=(int)std::ceil(width);
+  for(int q1=1;q1<columns;q1++)
+    {
+    int b=std::clamp(before(lt+(rt-lt)*q1/columns),picks.back(),e);
+    if(b!=picks.back())picks.push_back(b);
+    }
+  if(e>picks.back())picks.push_back(e);
+  toprint=4*(picks.size()-1);
+  }
+
+// largest triangle three buckets over c1..c2, kept until the visible range or the budget changes
+void ChanInfo::Segment::lttb(int budget)
+  {
+  level=-2;
+  std::array<size_t,3> key{evicted+c1,evicted+c2,(size_t)budget};
+  if(key==lttb_key){toprint=picks.size();return;}
+  lttb_key=key;
+  
+  picks.clear();
+  picks.push_back(c1);
+  
+  double every=double(c2-c1-1)/(budget-2);
+  int a=c1;
+  for(int q1=0;q1<budget-2;q1++)
+    {
+    // average of the next bucket is the third corner
+    int n1=c1+1+(int)((q1+1)*every);
+    int n2=std::min(c1+1+(int)((q1+2)*every),c2+1);
+    if(q1==budget-3){n1=c2;n2=c2+1;}
+    double at=0,ax=0;
+    for(int q2=n1;q2<n2;q2++){at+=time(q2);ax+=value(q2);}
+    at/=std::max(1,n2-n1);
+    ax/=std::max(1,n2-n1);
+    
+    int b1=c1+1+(int)(q1*every);
+    int b2=c1+1+(int)((q1+1)*every);
+    double ta=time(a),xa=value(a);
+    double best=-1;
+    int bi=b1;
+    for(int q2=b1;q2<b2;q2++)
+      {
+      double area=std::fabs((ta-at)*(value(q2)-xa)-(ta-time(q2))*(ax-xa));
+      if(area>best){best=area;bi=q2;}
+      }
+    picks.push_back(bi);
+    a=bi;
+    }
+  
+  picks.push_back(c2);
+  toprint=picks.size();
+  }
+
+// decimated vertices for the current c1..c2 relative to vastart, kept while the view is unchanged
+void ChanInfo::Segment::build_view(double starttime)
+  {
+  std::array<size_t,4> key{evicted+c1,evicted+c2,(size_t)stride*64+level+2,0};
+  if(level<=-2)std::memcpy(&key[3],&starttime,sizeof(double));
+  
+  if(std::isnan(vastart) || vwhole || key!=vkey)
+    {
+    vwhole=false;
+    vkey=key;
+    vastart=time(c1);
+    auto& va=vcache;
+    va.clear();
+    va.reserve(toprint*2);
+    
+    if(level==-1)for(int q2=c1;q2<=c2;q2+=stride)
+      {
+      va.push_back(time(q2)-vastart);
+      va.push_back(value(q2));
+      }
+    else if(level==-2)for(int q2:picks)
+      {
+      assert(q2>=0 && q2<size() && "picks outlived an eviction");
+      va.push_back(time(q2)-vastart);
+      va.push_back(value(q2));
+      }
+    else if(level==-3)for(size_t q2=0;q2+1<picks.size();q2++)
+      {
+      // the union of the column's bars reaches from 0 to its extreme values
+      auto e=minmax(picks[q2],picks[q2+1]);
+      double t1=time(picks[q2])-vastart,t2=time(picks[q2+1])-vastart;
+      double lo=std::min(0.0,e.mn),hi=std::max(0.0,e.mx);
+      for(double v:{t1,lo,t2,lo,t2,hi,t1,hi})va.push_back(v);
+      }
+    else
+      {
+      // both ends exact, whole nodes in between as their min and max in time order
+      size_t ns=MinMaxPyramid::nodesize(level);
+      va.push_back(time(c1)-vastart);
+      va.push_back(value(c1));
+      for(size_t k=(evicted+c1+ns-1)/ns;k<(evicted+c2+1)/ns;k++)
+        {
+        const auto& e=pyr.node(level,k);
+        int i1=k*ns-evicted+std::min(e.imn,e.imx);
+        int i2=k*ns-evicted+std::max(e.imn,e.imx);
+        va.push_back(time(i1)-vastart);
+        va.push_back(e.imn<e.imx?e.mn:e.mx);
+        va.push_back(time(i2)-vastart);
+        va.push_back(e.imn<e.imx?e.mx:e.mn);
+        }
+      va.push_back(time(c2)-vastart);
+      va.push_back(value(c2));
+      }
+    }
+  }
+
+// builds the nodes completed since the last call, every level only grows at its tail
+void ChanInfo::Segment::update_pyramid()
+  {
+  static constexpr int base=MinMaxPyramid::base;
+  size_t n=evicted+size();
+  
+  if(pyr.levels.empty()){pyr.levels.emplace_back();pyr.first.push_back(evicted>>base);}
+  
+  // a node with dropped samples can't be built any more, start past it
+  size_t k0=(evicted+(size_t(1)<<base)-1)>>base;
+  if(pyr.end(0)<k0){pyr.levels[0].clear();pyr.first[0]=k0;}
+  
+  for(size_t k=pyr.end(0);((k+1)<<base)<=n;k++)
+    {
+    size_t a=(k<<base)-evicted;
+    MinMaxPyramid::Node e{value(a),value(a),0,0};
+    for(int q1=1;q1<(1<<base);q1++)
+      {
+      double v=value(a+q1);
+      if(v<e.mn){e.mn=v;e.imn=q1;}
+      if(v>e.mx){e.mx=v;e.imx=q1;}
+      }
+    pyr.levels[0].push_back(e);
+    }
+  
+  for(int L=1;L<=pyr.numlevels();L++)
+    {
+    size_t k0=(pyr.first[L-1]+1)/2;
+    if(L==pyr.numlevels())
+      {
+      if(2*k0+2>pyr.end(L-1))break;
+      pyr.levels.emplace_back();
+      pyr.first.push_back(k0);
+      }
+    if(pyr.end(L)<k0){pyr.levels[L].clear();pyr.first[L]=k0;}
+    
+    int32_t half=MinMaxPyramid::nodesize(L-1);
+    for(size_t k=pyr.end(L);2*k+2<=pyr.end(L-1);k++)
+      pyr.levels[L].push_back(MinMaxPyramid::combine(pyr.node(L-1,2*k),pyr.node(L-1,2*k+1),half));
+    }
+  
+  // after an eviction the extent is found again through the pyramid, otherwise only new samples are folded in
+  if(hend<evicted)
+    {
+    hmin=1e300;
+    hmax=-1e300;
+    hend=evicted;
+    if(size()){auto e=minmax(0,size());hmin=e.mn;hmax=e.mx;hend=n;}
+    }
+  for(;hend<n;hend++)
+    {
+    double v=value(hend-evicted);
+    hmin=std::min(hmin,v);
+    hmax=std::max(hmax,v);
+    }
   }
 
 
@@ -453,12 +1255,54 @@ struct Instance
   svector < WindowInfo > windows{1<<12};
   svector < FrameInfo > frames{1<<8};
   
+  static constexpr int handle_bits=20;
+  static constexpr int handle_genmask=(1<<(31-handle_bits))-1;
+  svector < int > chan_gen{1<<16};
+  
   
   FrameInfo*cf=nullptr;
   
-  std::unordered_map < ChanInfo::Segment*, std::unique_ptr<pangolin::GlBuffer> > vbos;
+  BufferPool buffers;
+  std::vector<int> retained; // channels with a retention limit
+  bool retention_dirty=true;
+  StreamRing stream;
+  
+  // vertices that are streamed anyway (decimated views up to batch_vertices) and whole segments of
+  // at most tiny_vertices are packed per window, relative to its starttime, and drawn together with
+  // their neighbours in the same state. Larger whole segments keep their append-only VBO, repacking
+  // them would cost every visible sample each frame in follow mode.
+  static constexpr size_t batch_vertices=1<<14;
+  static constexpr size_t tiny_vertices=256;
+  struct
+    {
+    DrawState state;
+    std::vector<BatchVertex> va;
+    std::vector<float> floats; // a whole segment's vertices before they get their colours
+    std::vector<GLint> first;
+    std::vector<GLsizei> count;
+    } batch;
+  WorkerPool workers;
   std::unordered_map < std::string , int > uchannels,uframes,uwindows;
   
+  // frame/window/channel graph as seen by the renderer, rebuilt only when graph_epoch moves
+  struct RenderSnapshot
+    {
+    struct SegmentView { ChanInfo* chan; ChanInfo::Segment* seg; };
+    struct WindowView  { int id; WindowInfo* win; std::vector<SegmentView> segments; };
+    struct FrameView   { FrameInfo* frame; std::vector<WindowView> windows; double starttime=0,rendertime=0,timespan=1; };
+    
+    std::vector<FrameView> frames;
+    
+    // every window and segment of the graph as flat lists, the per frame preparation runs over these
+    struct WindowRef  { FrameView* fv; WindowView* wv; };
+    struct SegmentRef { FrameView* fv; WindowView* wv; SegmentView* v; };
+    std::vector<WindowRef> flat_windows;
+    std::vector<SegmentRef> flat_segments;
+    uint64_t epoch=~0ull;
+    } snapshot;
+  
+  uint64_t graph_epoch=0;
+  
   pangolin::View* drawing_area=nullptr;
   pangolin::WindowInterface* pango_window=nullptr;
   //InputHandler handler;
@@ -544,12 +1388,15 @@ struct Instance
   
   void flush_input_event_queue()
     {
-    std::lock_guard LG(input_queue_mutex);
-    while(!input_queue.empty())
+    std::queue<std::function<void()>> todo;
       {
-      auto f=input_queue.front();
-      input_queue.pop();
-      f();
+      std::lock_guard LG(input_queue_mutex);
+      std::swap(todo,input_queue);
+      }
+    while(!todo.empty())
+      {
+      todo.front()();
+      todo.pop();
       }
     }
 
@@ -576,9 +1423,44 @@ bool accept(double a)
   return true;
   }
 
+// appends the samples accept() keeps: whole blocks without a rejected value go in with
+// one copy, mixed blocks are compacted without a branch per sample
+void append_accepted(BlockStore<Sample>& v,const Sample* a,size_t num)
+  {
+  static constexpr double maxsample=1e36;
+  static constexpr size_t block=256;
+  
+  for(size_t q1=0;q1<num;)
+    {
+    size_t n=std::min(block,num-q1);
+    Sample* dst=v.extend(n);
+    const Sample* b=a+q1;
+    q1+=n;
+    
+    // fabs(NaN)<=maxsample is false, so this is accept() without branches
+    int bad=0;
+    for(size_t q2=0;q2<n;q2++)bad+=!(std::fabs(b[q2].x)<=maxsample);
+    
+    if(!bad){std::copy(b,b+n,dst);continue;}
+    
+    size_t k=0;
+    for(size_t q2=0;q2<n;q2++)
+      {
+      dst[k]=b[q2];
+      k+=std::fabs(b[q2].x)<=maxsample;
+      }
+    v.shrink(n-k);
+    }
+  }
+
 void clear_data(int q1)
   {
+  graph_epoch++;
+  frame_times_dirty(channels[q1]);
+  release_segments(channels[q1],0,channels[q1].data.size());
+  channels[q1].pending.clear();
   channels[q1].data.clear();
+  channels[q1].held_n=channels[q1].held_b=0;
   channels[q1].data2.clear();
   }
 void clear_data(const std::string& a)
@@ -601,27 +1483,202 @@ int firstfree(const std::unordered_map < std::string , int >& a)
   }
 
 
-void newsamples(const char*name,Sample* a,int num,bool newsegment=false)
+// moves the change in size of seg since it was last counted into the totals of its channel
+void account(ChanInfo::Segment& seg)
   {
-  int chnum=uchannels[name];
-  if(chnum==0){uchannels.erase(name);return;}
-  ChanInfo& ch=channels[chnum];
+  ChanInfo& ch=*seg.parent;
+  ch.held_n+=seg.size()-seg.held_n;
+  ch.held_b+=seg.bytes()-seg.held_b;
+  seg.held_n=seg.size();
+  seg.held_b=seg.bytes();
+  }
+
+// after samples went into seg: its summaries, the channel totals and the time extent of its frame
+// follow the new tail
+void appended(ChanInfo::Segment& seg)
+  {
+  seg.update_pyramid();
+  account(seg);
+  ChanInfo& ch=*seg.parent;
+  if(!ch.active || !seg.size() || !ch.win || !ch.win->fr)return;
+  FrameInfo& f=*ch.win->fr;
+  f.ext_last =std::max(f.ext_last ,seg.time(seg.size()-1));
+  f.ext_first=std::min(f.ext_first,seg.time(0));
+  }
+
+// segments hand their VBOs back when they are dropped, the renderer never has to look for orphans
+void release_segments(ChanInfo& ch,size_t a,size_t b)
+  {
+  for(size_t q1=a;q1<b;q1++)buffers.release(ch.data[q1].vbo);
+  }
+
+// the frame extent can only shrink through a full rescan of the frame's channels
+void frame_times_dirty(ChanInfo& ch)
+  {
+  if(ch.win && ch.win->fr)ch.win->fr->ext_dirty=true;
+  }
+
+ChanInfo::Segment& appendsegment(ChanInfo& ch,bool newsegment)
+  {
+  flush_pending(ch);
   
-  if(ch.data.size()==0 || newsegment)ch.data.emplace_back();
+  if(ch.data.size()==0 || newsegment){ch.data.emplace_back();graph_epoch++;}
   
-  ch.data.back().vastart=std::nan("");
   ch.data.back().parent=&ch;
+  return ch.data.back();
+  }
+
+// single samples are coalesced per channel and appended once per frame or when the buffer fills
+static constexpr size_t max_pending=4096;
+std::vector<int> pending_channels;
+
+void flush_pending(ChanInfo& ch)
+  {
+  if(ch.pending.empty())return;
+  
+  std::vector<Sample> p;
+  std::swap(p,ch.pending);
+  
+  auto& seg=appendsegment(ch,false);
+  seg.materialize();
+  seg.data.append(p.data(),p.size());
+  appended(seg);
+  
+  p.clear();
+  std::swap(p,ch.pending);
+  }
+
+void flush_all_pending()
+  {
+  for(auto&c:pending_channels)if(channels[c].used)flush_pending(channels[c]);
+  pending_channels.clear();
+  }
+
+void newsample(int chnum,const Sample& a)
+  {
+  if(!accept(a.x))return;
+  
+  auto& p=channels[chnum].pending;
+  if(p.empty())pending_channels.push_back(chnum);
+  p.push_back(a);
+  if(p.size()>=max_pending)flush_pending(channels[chnum]);
+  }
+
+void newsamples(int chnum,Sample* a,int num,bool newsegment=false)
+  {
+  ChanInfo& ch=channels[chnum];
+  
+  appendsegment(ch,newsegment);
   
   //printf("%s %zu\n",ch.name.c_str(),ch.data.back().data.size());
   //for(int q1=0;q1<num;q1++)if(accept(a->x))ch->data.push_back(*(a++));
   
-  for(int q1=0;q1<num;q1++)if(accept(a[q1].x))ch.data.back().data.push_back(a[q1]);
+  ch.data.back().materialize();
+  if(num>0)append_accepted(ch.data.back().data,a,num);
+  appended(ch.data.back());
   //else printf("%lf %lf\n",a[q1].x,a[q1].t);
   
   //while(ch->data.size()>maxxx*2)ch->data.erase(ch->data.begin(),ch->data.begin()+maxxx);
   //printf("%s %zu\n",ch.name.c_str(),ch.data.back().data.size());
   }
 
+void newsamples(const char*name,Sample* a,int num,bool newsegment=false)
+  {
+  int chnum=uchannels[name];
+  if(chnum==0){uchannels.erase(name);return;}
+  newsamples(chnum,a,num,newsegment);
+  }
+
+// compressed payload, see GorillaDecoder, decoded in place at the end of the segment
+void newsamples_gorilla(int chnum,const unsigned char*a,int num,bool newsegment=false)
+  {
+  if(num<=0)return;
+  
+  auto& seg=appendsegment(channels[chnum],newsegment);
+  seg.materialize();
+  GorillaDecoder dec(a);
+  for(int q1=0;q1<num;)
+    {
+    size_t n=num-q1,k=0;
+    Sample* dst=seg.data.extend(n);
+    for(size_t q2=0;q2<n;q2++,q1++)
+      {
+      if(q1)dec.next();
+      dst[k]=dec.sample();
+      k+=accept(dst[k].x);
+      }
+    seg.data.shrink(n-k);
+    }
+  appended(seg);
+  }
+
+// fixed rate run, kept as values only while it keeps extending the segment's timebase
+void newsamples_uniform(int chnum,double t0,double dt,const double*v,int num,bool newsegment=false)
+  {
+  if(num<=0)return;
+  
+  bool valid=dt>0;
+  for(int q1=0;q1<num;q1++)valid&=accept(v[q1]);
+  
+  auto& seg=appendsegment(channels[chnum],newsegment);
+  
+  if(valid && seg.size()==0){seg.uniform=true;seg.t0=t0;seg.dt=dt;seg.values.append(v,num);}
+  else if(valid && seg.continues(t0,dt))seg.values.append(v,num);
+  else
+    {
+    seg.materialize();
+    for(int q1=0;q1<num;q1++)if(accept(v[q1]))seg.data.push_back({t0+q1*dt,v[q1]});
+    }
+  appended(seg);
+  }
+
+// payload of opcodes 4 and 7 for channel c, s.d[3] selects the encoding:
+// 0 Sample array, 1 Gorilla stream, 2 t0,dt followed by the values
+void samples_packet(int c,CommStruct& s)
+  {
+  if(s.d[1])clear_data(c);
+  
+  const double* u=(const double*)(s.c+64);
+  
+  if(s.d[3]==1)newsamples_gorilla(c,s.uc+64,s.i[1],s.d[2]);
+  else if(s.d[3]==2)newsamples_uniform(c,u[0],u[1],u+2,s.i[1],s.d[2]);
+  else newsamples(c,(Sample*)(s.c+64),s.i[1],s.d[2]);
+  }
+
+int newsamples_batch(const char*a,int entries)
+  {
+  const BatchEntry* e=(const BatchEntry*)a;
+  Sample* payload=(Sample*)(a+entries*sizeof(BatchEntry));
+  
+  int total=0;
+  for(int q1=0;q1<entries;q1++)
+    {
+    int c=handle_channel(e[q1].handle);
+    if(!c)continue;
+    if(e[q1].flags&BatchEntry::clear)clear_data(c);
+    newsamples(c,payload+e[q1].offset,e[q1].count,e[q1].flags&BatchEntry::newsegment);
+    total+=e[q1].count;
+    }
+  return total;
+  }
+
+// handle = channel slot in the low bits, slot generation above, so a handle kept
+// by a producer after remove_channel resolves to nothing instead of a reused slot
+int channel_handle(const std::string& name)
+  {
+  auto i=uchannels.find(name);
+  if(i==uchannels.end())return 0;
+  return i->second | ((chan_gen[i->second]&handle_genmask)<<handle_bits);
+  }
+
+int handle_channel(int h)
+  {
+  int c=h&((1<<handle_bits)-1);
+  if(c==0 || c>=(int)channels.data.size() || !channels[c].used)return 0;
+  if((chan_gen[c]&handle_genmask)!=(h>>handle_bits))return 0;
+  return c;
+  }
+
 void newimage(const char* name, float* data)
   {
   int chnum=uchannels[name];
@@ -646,14 +1703,19 @@ void newimage(const char* name, float* data)
   d.dt=data[6];
   d.dx=data[7];
   
+  release_segments(ch,0,ch.data.size());
   ch.data.clear();
+  ch.held_n=ch.held_b=0;
   ch.data.emplace_back();
+  graph_epoch++;
+  frame_times_dirty(ch);
   ch.data[0].parent=&ch;
-  ch.data[0].data={{d.t1,d.x1},{d.t2,d.x2}};
+  ch.data[0].data.push_back({d.t1,d.x1});
+  ch.data[0].data.push_back({d.t2,d.x2});
   
   //printf("%f %f %f %f %f %f   %d %d %d\n",d.x1,d.x2,d.t1,d.t2,d.dx,d.dt,d.h,d.w,w);
   
-  for(int q1=0;q1<w*h*3;q1++)d.data.push_back(data[16+q1]);
+  d.data.insert(d.data.end(),data+16,data+16+(size_t)w*h*3);
   //printf("%zu\n",d.data.size());
   //d.image.Reinitialise(w,h,pangolin::PixelFormatFromString("RGB96F"));
   //memcpy(d.image.ptr,data+16,d.image.SizeBytes());
@@ -694,7 +1756,9 @@ void remove_window(const std::string& name)
   int w=uwindows[name];
   if(!w){uwindows.erase(name);return;}
   WindowInfo& win=windows[w];
+  graph_epoch++;
   win.used=0;
+  win.fr->ext_dirty=true;
   win.fr->windows.erase(w);
   uwindows.erase(name);
   win=WindowInfo{};
@@ -704,6 +1768,13 @@ void remove_channel(const std::string& name)
   {
   int c=uchannels[name];
   if(!c){uchannels.erase(name);return;}
+  graph_epoch++;
+  frame_times_dirty(channels[c]);
+  release_segments(channels[c],0,channels[c].data.size());
+  retention_dirty=true;
+  channels[c].pending.clear();
+  channels[c].data2.clear();
+  chan_gen[c]++;
   channels[c].used=0;
   channels[c].win->channels.erase(c);
   //if(channels[c].win->channels.size()==0)remove_window(channels[c].win->name);
@@ -715,13 +1786,29 @@ void deactivate_channel(const std::string& name)
   int c=uchannels[name];
   if(!c){uchannels.erase(name);return;}
   channels[c].active=0;
+  frame_times_dirty(channels[c]);
   }
 
 void sort_channel(const std::string& name)
   {
   int c=uchannels[name];if(!c){uchannels.erase(name);return;}
   //  bool operator < (const Sample& other) const {return t<other.t;}
-  for(auto&s:channels[c].data)sort(s.data.begin(),s.data.end(),[](const Sample& a, const Sample& b){return a.t<b.t;});
+  for(auto&s:channels[c].data)if(!s.uniform)
+    {
+    std::vector<Sample> v(s.data.size());
+    for(size_t q1=0;q1<v.size();q1++)v[q1]=s.data[q1];
+    sort(v.begin(),v.end(),[](const Sample& a, const Sample& b){return a.t<b.t;});
+    
+    // only the part that moved loses its summary
+    size_t q1=0;
+    while(q1<v.size() && v[q1].t==s.data[q1].t && v[q1].x==s.data[q1].x)q1++;
+    if(q1==v.size())continue;
+    s.invalidate_from(q1);
+    for(;q1<v.size();q1++)s.data[q1]=v[q1];
+    s.update_pyramid();
+    s.vastart=sw_qnan();
+    frame_times_dirty(channels[c]);
+    }
   }
 
 void remove_window2(const std::string& name)
@@ -729,6 +1816,7 @@ void remove_window2(const std::string& name)
   int w=uwindows[name];
   if(!w){uwindows.erase(name);return;}
   WindowInfo& win=windows[w];
+  graph_epoch++;
   auto cc=win.channels;
   for(auto&c:cc)remove_channel(channels[c].name);
   win=WindowInfo{};
@@ -740,6 +1828,7 @@ void remove_frame(const std::string& name)
   {
   int f=uframes[name];
   if(!f){uframes.erase(name);return;}
+  graph_epoch++;
   frames[f].used=0;
   //for(auto&c:uchannels)if(channels[c.second].win->fr->name==name)remove_channel(channels[c.second].name);
   for(auto&w:frames[f].windows)remove_window2(windows[w].name);
@@ -857,6 +1946,7 @@ void configchannel(const char*a)
   WindowInfo& win=windows[w];
   ChanInfo& chan=channels[c];
   
+  graph_epoch++;
   
   //printf("%s    %s    %s\n",name.c_str(),window.c_str(),frame.c_str());
   if(channels[c].win)assert(channels[c].win==&win && "cannot reassign channel window");
@@ -887,12 +1977,13 @@ void configchannel(const char*a)
     if(i.first=="autor") {win.autorange=(int)i.second;printf("%s %d\n",name.c_str(),win.autorange);}
     if(i.first=="names") win.names=(int)i.second;
     if(i.first=="logsc") win.logsc=(int)i.second;
+    if(i.first=="dens")  win.density=(int)i.second;
     
     if(i.first=="red")  chan.style.r=i.second;
     if(i.first=="green")chan.style.g=i.second;
     if(i.first=="blue" )chan.style.b=i.second;
     if(i.first=="alpha")chan.style.a=i.second;
-    if(i.first=="style")chan.style.style=(int)i.second;
+    if(i.first=="style"){chan.style.style=(int)i.second;for(auto&s:chan.data)s.vastart=sw_qnan();}
     if(i.first=="width")chan.style.width=i.second;
     
     if(i.first=="wintab")chan.wintab=(int)i.second;
@@ -901,12 +1992,19 @@ void configchannel(const char*a)
     if(i.first=="active")chan.active=(int)i.second;
     
     if(i.first=="perpix")chan.samplesperpixel=i.second;
+    if(i.first=="decim"){chan.decim=(int)i.second;for(auto&s:chan.data){s.lttb_key={};s.vastart=sw_qnan();}}
     
     if(i.first=="clear")if((int)i.second==1)clear_data(c);
     
+    if(i.first=="keepn")chan.keep.samples=i.second;
+    if(i.first=="keept")chan.keep.age=i.second;
+    if(i.first=="keepb")chan.keep.bytes=i.second;
+    
     }
   
   if(!win.autorange)win.reconfigured=1;
+  frame_times_dirty(chan);
+  retention_dirty=true;
   chan.im_name.text=dname;
   chan.im_label.text=label;
   
@@ -929,6 +2027,7 @@ void configframe(const char*a)
   if(uframes.find(name)==uframes.end()){f=uframes[name]=firstfree(uframes);frames[f]=FrameInfo();}else f=uframes[name];
   
   
+  graph_epoch++;
   frames[f].used=1;
   frames[f].name=name;
   
@@ -957,6 +2056,11 @@ void configframe(const char*a)
     if(i.first=="x2")frames[f].x2=i.second;
     if(i.first=="y2")frames[f].y2=i.second;
     
+    if(i.first=="keepn")frames[f].keep.samples=i.second;
+    if(i.first=="keept")frames[f].keep.age=i.second;
+    if(i.first=="keepb")frames[f].keep.bytes=i.second;
+    if(i.first.compare(0,4,"keep")==0)retention_dirty=true;
+    
     }
   
   //if(!(old==frames[f]))frames[f].reconfigured=1;
@@ -1006,187 +2110,279 @@ struct CommHandler
   SharedMemoryOne sms;
   CommStruct ss{1<<10};
   
+  // one packet copied out of smc by the receiver thread
+  struct Packet
+    {
+    std::unique_ptr<CommStruct> cs;
+    int cap=0;
+    int len=0;
+    };
+  
+  static constexpr size_t max_queued_bytes=size_t(1)<<28;
+  static constexpr int max_recycled_size=1<<20;
+  
+  spsc_queue < Packet > incoming;
+  spsc_queue < Packet > recycled;
+  std::atomic<size_t> queued_bytes{0};
+  std::thread receiver;
+  
   int samples=0;
   int packets=0;
-  int cnt=0;
+  int group=0;
   
   CommHandler(const std::string& name) : smc(name,1<<24,false), sms(name+"-feedback",1<<16,false) {}
   };
 
 std::unique_ptr<CommHandler> comm;
 
+// receiver thread: drains smc as fast as the producer writes and hands the packets
+// to the render thread, never touches anything guarded by configdata
 void listen_main()
   {
-  
   SharedMemoryOne& smc=comm->smc;
   CommStruct& s=comm->s;
   
-  while(1) 
+  while(!stopped)
     {
     int c1=smc.receive2(s.d,false);
     
-    //if(c1)printf("%d\n",c1);
-    
-    if(c1==0)break;
-    
-    std::lock_guard LG(configdata);
-    
-    maint.start(100);
-    
-    /// add flash functionality
-    
-     
-    if(s.d[0]==11)remove_all_channels();
-    if(s.d[0]==12)remove_channel(s.c+32);
-    if(s.d[0]==15)deactivate_all_channels();
-    
-    if(s.d[0]==21)clear_all_data();
-    if(s.d[0]==22)clear_data(s.c+32);
-    
-    
-    if(s.d[0]==31)remove_all_frames();
-    if(s.d[0]==32)remove_frame(s.c+32);
-    if(s.d[0]==33)hide_all_frames();
-    if(s.d[0]==35)show_all_frames_prefix(s.c+32);
-    if(s.d[0]==37)follow_all_frames();
-    
-    if(s.d[0]==41)remove_window2(s.c+32);
+    if(c1==0){usleep(100);continue;}
     
-    if(s.d[0]==51)sort_channel(s.c+32);
-    
-    if(s.d[0]==61)
-      {
-      while(screenshot.take==1)
-        {
-        configdata.unlock();
-        usleep(1000);
-        configdata.lock();
-        }
-      screenshot.precise=true;
-      screenshot.blocking=s.i[1];
-      screenshot.dest=s.c+32;
-      screenshot.take=1;
-      screenshot.sizex=sizex;
-      screenshot.sizey=sizey;
-      screenshot.x=screenshot.y=0;
-      }
-    if(s.d[0]==65)
+    CommHandler::Packet p;
+    if(auto*r=comm->recycled.front())
       {
-      for(int q1=0;q1<4;q1++)bg_col[q1]=s.data[4+q1];
-      for(int q1=0;q1<3;q1++)fg_col[q1]=1-s.data[4+q1];
+      if(r->cap>=c1)p=std::move(*r);
+      comm->recycled.pop();
       }
+    if(!p.cs){p.cs=std::make_unique<CommStruct>(c1);p.cap=c1;}
     
+    memcpy(p.cs->d,s.d,c1);
+    p.len=c1;
     
-    if(s.d[0]==71)addtexttoframe(s.c);
-    if(s.d[0]==72)delete_text_frame(s.c+32);
-    
-    if(s.d[0]==81)
+    while(comm->queued_bytes>CommHandler::max_queued_bytes || !comm->incoming.push(p))
       {
-      size_request=1;
-      size_request_x=s.i[1];
-      size_request_y=s.i[2];
+      if(stopped)return;
+      usleep(100);
       }
-    if(s.d[0]==82)
+    comm->queued_bytes+=c1;
+    }
+  }
+
+// render thread, configdata held: applies everything received since the last frame
+void apply_packets()
+  {
+  auto& q=comm->incoming;
+  
+  while(1)
+    {
+    CommHandler::Packet* p=q.front();
+    
+    // inside a 91..92 group the frame waits for the rest of the group
+    if(!p)
       {
-      if(std::string(s.c+8)=="display_lines")displaylists=s.i[1];
-      if(std::string(s.c+8)=="display_fonts")displayfonts=s.i[1];
-      if(std::string(s.c+8)=="iconify")iconify=s.i[1];
+      if(!comm->group || stopped)break;
+      usleep(100);
+      continue;
       }
     
-    int& cnt=comm->cnt;
-    int& samples=comm->samples;
-    int& packets=comm->packets;
+    // previous screenshot not taken yet, leave the request for the next frame
+    if(p->cs->d[0]==61 && screenshot.take==1)break;
     
-    if(s.d[0]==91)
-      {
-      while(cnt){configdata.unlock();cnt--;}
-      configdata.lock();
-      samples=packets=0;
-      cnt++;
-      maint.start(201);
-      }
-    if(s.d[0]==92)
-      {
-      maint.stop(201);
-      if(print_stats)printf("Time to unlock: %lf   \t  %d packets   %d samples\n",maint(201),packets,samples);
-      if(cnt){cnt--;configdata.unlock();}
-      }
+    process_packet(*p->cs);
     
-    if(s.d[0]==111)
-      {
-      maint.start(104);
-      configframe(s.c);
-      maint.stop(104);
-      }
+    CommHandler::Packet done=std::move(*p);
+    q.pop();
+    comm->queued_bytes-=done.len;
+    if(done.cap<=CommHandler::max_recycled_size)comm->recycled.push(done);
+    }
   
-    if(s.d[0]==101)
-      {
-      maint.start(103);
-      configchannel(s.c);
-      maint.stop(103);
-      }
-    
-    if(s.d[0]==151 && s.d[1]==1)
-      {
-      //printf("LINKING: %s %s\n",s.c+32,s.c+128);
-      
-      frames[uframes[s.c+32]].linked_frames_time.push_back(s.c+128);
-      }
+  flush_all_pending();
+  }
+
+void process_packet(CommStruct& s)
+  {
+  maint.start(100);
+  
+  /// add flash functionality
+  
+   
+  if(s.d[0]==11)remove_all_channels();
+  if(s.d[0]==12)remove_channel(s.c+32);
+  if(s.d[0]==15)deactivate_all_channels();
+  
+  if(s.d[0]==21)clear_all_data();
+  if(s.d[0]==22)clear_data(s.c+32);
+  
+  
+  if(s.d[0]==31)remove_all_frames();
+  if(s.d[0]==32)remove_frame(s.c+32);
+  if(s.d[0]==33)hide_all_frames();
+  if(s.d[0]==35)show_all_frames_prefix(s.c+32);
+  if(s.d[0]==37)follow_all_frames();
+  
+  if(s.d[0]==41)remove_window2(s.c+32);
+  
+  if(s.d[0]==51)sort_channel(s.c+32);
+  
+  if(s.d[0]==61)
+    {
+    screenshot.precise=true;
+    screenshot.blocking=s.i[1];
+    screenshot.dest=s.c+32;
+    screenshot.take=1;
+    screenshot.sizex=sizex;
+    screenshot.sizey=sizey;
+    screenshot.x=screenshot.y=0;
+    }
+  if(s.d[0]==65)
+    {
+    for(int q1=0;q1<4;q1++)bg_col[q1]=s.data[4+q1];
+    for(int q1=0;q1<3;q1++)fg_col[q1]=1-s.data[4+q1];
+    }
+  
+  
+  if(s.d[0]==71)addtexttoframe(s.c);
+  if(s.d[0]==72)delete_text_frame(s.c+32);
+  
+  if(s.d[0]==81)
+    {
+    size_request=1;
+    size_request_x=s.i[1];
+    size_request_y=s.i[2];
+    }
+  if(s.d[0]==82)
+    {
+    if(std::string(s.c+8)=="display_lines")displaylists=s.i[1];
+    if(std::string(s.c+8)=="display_fonts")displayfonts=s.i[1];
+    if(std::string(s.c+8)=="iconify")iconify=s.i[1];
+    }
+  
+  int& samples=comm->samples;
+  int& packets=comm->packets;
+  
+  if(s.d[0]==91)
+    {
+    comm->group=1;
+    samples=packets=0;
+    maint.start(201);
+    }
+  if(s.d[0]==92)
+    {
+    maint.stop(201);
+    if(print_stats)printf("Time to unlock: %lf   \t  %d packets   %d samples\n",maint(201),packets,samples);
+    comm->group=0;
+    }
+  
+  if(s.d[0]==111)
+    {
+    maint.start(104);
+    configframe(s.c);
+    maint.stop(104);
+    }
+
+  if(s.d[0]==101)
+    {
+    maint.start(103);
+    configchannel(s.c);
+    maint.stop(103);
+    }
+  
+  if(s.d[0]==151 && s.d[1]==1)
+    {
+    //printf("LINKING: %s %s\n",s.c+32,s.c+128);
     
-    if(s.d[0]==201) draw_curtab=s.i[1];
-    if(s.d[0]==202) use_dynamic_range=s.i[1];
+    frames[uframes[s.c+32]].linked_frames_time.push_back(s.c+128);
+    }
+  
+  if(s.d[0]==201) draw_curtab=s.i[1];
+  if(s.d[0]==202) use_dynamic_range=s.i[1];
+  
+  
+  // one Sample at c+64, coalesced until the end of apply_packets
+  if(s.d[0]==3)
+    {
+    maint.start(101);
+    packets++;
+    if(int c=uchannels[s.c+8])newsample(c,*(Sample*)(s.c+64));
+    else uchannels.erase(s.c+8);
+    samples++;
+    maint.stop(101);
+    }
+  
+  if(s.d[0]==4)
+    {
+    maint.start(102);
     
+    packets++;
+    //printf("++++++++++++%s %d %d\n",s.c+8,chnum,s.i[1]);
+    if(int c=uchannels[s.c+8])samples_packet(c,s);
+    else uchannels.erase(s.c+8);
     
-    if(s.d[0]==3)
-      {
-      printf("Single sample method unsupported\n");
-      }
+    //printf("============%s %d %d\n",s.c+8,chnum,s.i[1]);
+    samples+=s.i[1];
+    maint.stop(102);
+    }
+  
+  // register: reply on the feedback channel with a handle for opcode 7
+  if(s.d[0]==6)
+    {
+    CommStruct& cs=comm->ss;
+    cs.d[0]=12;
+    strncpy(cs.c+32,s.c+8,96);
+    cs.data[1]=channel_handle(s.c+8);
+    comm->sms.send2(cs.d,128,0);
+    }
+  
+  // same as 4, channel addressed by the handle in s.i[2] instead of the name
+  if(s.d[0]==7)
+    {
+    maint.start(102);
     
-    if(s.d[0]==4)
+    packets++;
+    if(int c=handle_channel(s.i[2]))
       {
-      maint.start(102);
-      
-      packets++;
-      //printf("++++++++++++%s %d %d\n",s.c+8,chnum,s.i[1]);
-      if(s.d[1])clear_data(s.c+8);
-      //printf("------------%s %d %d\n",s.c+8,chnum,s.i[1]);
-      newsamples(s.c+8,(Sample*)(s.c+64),s.i[1],s.d[2]);
-      
-      //printf("============%s %d %d\n",s.c+8,chnum,s.i[1]);
+      samples_packet(c,s);
       samples+=s.i[1];
-      maint.stop(102);
       }
+    maint.stop(102);
+    }
+  
+  // many channels per packet: s.i[1] BatchEntry records at c+64, then the samples
+  if(s.d[0]==8)
+    {
+    maint.start(102);
+    packets++;
+    samples+=newsamples_batch(s.c+64,s.i[1]);
+    maint.stop(102);
+    }
+  
+  if(s.d[0]==5)
+    {
+    maint.start(102);
+    if(s.d[1])clear_data(s.c+8);
     
-    if(s.d[0]==5)
-      {
-      maint.start(102);
-      if(s.d[1])clear_data(s.c+8);
-      
-      newimage(s.c+8,s.f+16);
-      
-      
-      
-      maint.stop(102);
-      }
+    newimage(s.c+8,s.f+16);
     
-    maint.stop(100);
     
-    while(maint(110)>1.0)
-      {
-      break;
-      //maint.start(110);
-      //printf("total: %lf \t",maint.acc(100)*1000);
-      //printf("single: %lf \t",maint.acc(101)*1000);
-      //printf("multiple: %lf \t",maint.acc(102)*1000);
-      //printf("confchan: %lf \t",maint.acc(103)*1000);
-      //printf("conffr: %lf \t",maint.acc(104)*1000);
-      //printf("chanprep: %lf \t",maint.acc(105)*1000);
-      //printf("\n");
-      
-      }
     
+    maint.stop(102);
     }
   
+  maint.stop(100);
+  
+  while(maint(110)>1.0)
+    {
+    break;
+    //maint.start(110);
+    //printf("total: %lf \t",maint.acc(100)*1000);
+    //printf("single: %lf \t",maint.acc(101)*1000);
+    //printf("multiple: %lf \t",maint.acc(102)*1000);
+    //printf("confchan: %lf \t",maint.acc(103)*1000);
+    //printf("conffr: %lf \t",maint.acc(104)*1000);
+    //printf("chanprep: %lf \t",maint.acc(105)*1000);
+    //printf("\n");
+    
+    }
   }
 
 
@@ -1198,22 +2394,7 @@ void findminmax(WindowInfo& win)
   double mn=maxsample;
   double mx=-maxsample;
   for(auto&c:win.channels)if(channels[c].active)for(auto&segment:channels[c].data)
-    {
-    static constexpr int numsamplesminmax=128;
-    
-    int c2=segment.c2;
-    int c1=segment.c1;
-    int skip=(c2-c1+1)/numsamplesminmax;
-    if(skip==0)skip=1;
-    if(win.minskip)skip=std::min(skip,win.minskip);
-    //if(win.name=="eit-hp.12.eit-hp.12")
-    //printf("%30s:  %6d %6d %6d\n",channels[c].name.c_str(),c1,c2,skip);
-    for(int q1=c2;q1>=c1;q1-=skip)
-      {
-      if(mn>segment.data[q1].x)mn=segment.data[q1].x;
-      if(mx<segment.data[q1].x)mx=segment.data[q1].x;
-      }
-    }
+    segment.visible_minmax(mn,mx);
   if(mn==maxsample||mx==-maxsample){mn=0;mx=1;}
   else if(mn==mx){mn-=0.5,mx+=0.5;}
   
@@ -1253,11 +2434,7 @@ void findminmax_total(WindowInfo& win)
   double mx=-maxsample;
   for(auto&c:win.channels)if(channels[c].active)if(channels[c].wintab==win.curtab)
     {
-    for(auto&e2:channels[c].data)for(auto&e1:e2.data)
-      {
-      if(mn>e1.x)mn=e1.x;
-      if(mx<e1.x)mx=e1.x;
-      }
+    for(auto&e2:channels[c].data)e2.history_minmax(mn,mx);
     }
   //printf("%d: %lf %lf\n",w,mx,mn);
   if(mn==maxsample||mx==-maxsample){mn=0;mx=1;}
@@ -1288,21 +2465,90 @@ void findminmax_total(WindowInfo& win)
 
 
 
+// drops the oldest samples of every channel over its limits, segments that run empty go away
+void apply_retention(ChanInfo& ch)
+  {
+  if(!ch.win || !ch.win->fr)return;
+  const FrameInfo& fr=*ch.win->fr;
+  double maxn=ch.keep.samples>0?ch.keep.samples:fr.keep.samples;
+  double maxt=ch.keep.age    >0?ch.keep.age    :fr.keep.age;
+  double maxb=ch.keep.bytes  >0?ch.keep.bytes  :fr.keep.bytes;
+  if(maxn<=0 && maxt<=0 && maxb<=0)return;
+  
+  double n=ch.held_n,b=ch.held_b;
+  
+  size_t emptied=0;
+  for(auto&s:ch.data)
+    {
+    size_t size=s.size();
+    double bps=s.uniform?sizeof(double):sizeof(Sample);
+    size_t drop=0;
+    if(maxn>0 && n>maxn)drop=std::max(drop,(size_t)std::min<double>(size,n-maxn));
+    if(maxb>0 && b>maxb)drop=std::max(drop,(size_t)std::min<double>(size,std::ceil((b-maxb)/bps)));
+    if(maxt>0)drop=std::max(drop,(size_t)s.before(fr.lasttime-maxt));
+    
+    if(drop)frame_times_dirty(ch);
+    s.evict(drop);
+    account(s);
+    n-=drop;
+    b-=drop*bps;
+    if(drop<size)break;
+    emptied++;
+    }
+  
+  // the last segment stays so appends keep going to it
+  emptied=std::min(emptied,ch.data.size()-1);
+  if(emptied==0)return;
+  
+  for(auto&s:ch.data)if(chanselect==&s)chanselect=nullptr;
+  release_segments(ch,0,emptied);
+  for(size_t q1=0;q1<emptied;q1++){ch.held_n-=ch.data[q1].held_n;ch.held_b-=ch.data[q1].held_b;}
+  ch.data.erase(ch.data.begin(),ch.data.begin()+emptied);
+  graph_epoch++;
+  }
+
+// only channels with a limit of their own or from their frame are looked at, the list is
+// rebuilt when a keep key, a channel or a frame changes
+void apply_retention()
+  {
+  if(retention_dirty)
+    {
+    retention_dirty=false;
+    retained.clear();
+    for(auto&i:uchannels)
+      {
+      const ChanInfo& ch=channels[i.second];
+      if(!ch.used || !ch.win || !ch.win->fr)continue;
+      auto& k=ch.keep;
+      auto& fk=ch.win->fr->keep;
+      if(k.samples>0 || k.age>0 || k.bytes>0 || fk.samples>0 || fk.age>0 || fk.bytes>0)retained.push_back(i.second);
+      }
+    }
+  for(int c:retained)apply_retention(channels[c]);
+  }
+
 void findlasttimes()
   {
   constexpr double inf=1e100;
   
-  for(auto&i:uframes){frames[i.second].lasttime=-inf;frames[i.second].firsttime=inf;}
-  for(auto&i:uchannels)
+  // appends only widen ext_first,ext_last, anything that can shrink them marks the frame for a rescan
+  for(auto&i:uframes)
     {
-    const ChanInfo& c=channels[i.second];
-    if(!c.active)continue;
-    for(auto&s:c.data)
+    FrameInfo& f=frames[i.second];
+    if(f.ext_dirty)
       {
-      if(!s.data.size())continue;
-      if(s.data.back().t > c.win->fr->lasttime )c.win->fr->lasttime =s.data.back().t;
-      if(s.data[0].t     < c.win->fr->firsttime)c.win->fr->firsttime=s.data[0].t;
+      f.ext_dirty=false;
+      f.ext_first=inf;
+      f.ext_last=-inf;
+      for(auto&w:f.windows)for(auto&c:windows[w].channels)if(channels[c].active)for(auto&s:channels[c].data)
+        {
+        if(!s.size())continue;
+        f.ext_last =std::max(f.ext_last ,s.time(s.size()-1));
+        f.ext_first=std::min(f.ext_first,s.time(0));
+        }
       }
+    f.lasttime=f.ext_last;
+    f.firsttime=f.ext_first;
     }
     
   for(auto&i:uframes)if(frames[i.second].lasttime==-inf)frames[i.second].lasttime=1;
@@ -1832,6 +3078,57 @@ void test_lines_shader()
   }
 
 
+// scale lines are kept on the CPU and streamed every frame they are drawn
+void render_shaderlines(const std::vector<OneVertex>& pts)
+  {
+  maint.start(24);
+  GLintptr off=stream.push(pts.data(),pts.size()*sizeof(OneVertex));
+  maint.stop(24);
+  
+  line_shader.Bind();
+  glBindBuffer(GL_ARRAY_BUFFER,stream.bo);
+  
+  for(auto&i:attribpos)glEnableVertexAttribArray(i.second);
+  glVertexAttribPointer(attribpos["vertex"]  ,4,GL_FLOAT,0,sizeof(OneVertex),(void*)(off+0) );
+  glVertexAttribPointer(attribpos["normal"]  ,3,GL_FLOAT,0,sizeof(OneVertex),(void*)(off+16));
+  glVertexAttribPointer(attribpos["texcoord"],2,GL_FLOAT,0,sizeof(OneVertex),(void*)(off+28));
+  
+  totallinepts+=pts.size();
+  
+  maint.start(21);// drawnum
+  glDrawArrays(GL_TRIANGLES,0,pts.size());
+  maint.stop(21);// drawnum
+  
+  for(auto&i:attribpos)glDisableVertexAttribArray(i.second);
+  
+  line_shader.Unbind();
+  glBindBuffer(GL_ARRAY_BUFFER,0);
+  }
+
+// textured quad of 4 corners, tex and pos as x,y pairs
+void render_text_quad(const double* tex,const double* pos)
+  {
+  float v[16];
+  for(int q1=0;q1<4;q1++)
+    {
+    v[q1*4+0]=pos[q1*2+0];
+    v[q1*4+1]=pos[q1*2+1];
+    v[q1*4+2]=tex[q1*2+0];
+    v[q1*4+3]=tex[q1*2+1];
+    }
+  GLintptr off=stream.push(v,sizeof(v));
+  
+  glBindBuffer(GL_ARRAY_BUFFER,stream.bo);
+  glVertexPointer  (2,GL_FLOAT,4*sizeof(float),(void*)(off));
+  glTexCoordPointer(2,GL_FLOAT,4*sizeof(float),(void*)(off+2*sizeof(float)));
+  glEnableClientState(GL_VERTEX_ARRAY);
+  glEnableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDrawArrays(GL_QUADS,0,4);
+  glDisableClientState(GL_TEXTURE_COORD_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glBindBuffer(GL_ARRAY_BUFFER,0);
+  }
+
 void scales_win_nodl(int win)
   {
   //FrameInfo*curframe=cf;
@@ -1909,11 +3206,6 @@ void scales_win_nodl(int win)
     //printf("BEFORE: %s\n",gluErrorString(glGetError()));
     
     
-    maint.start(24);
-    w.vbo.Reinitialise(pangolin::GlArrayBuffer,pts.size(),GL_FLOAT,sizeof(pts[0])/sizeof(float),GL_DYNAMIC_DRAW);
-    w.vbo.Upload(pts.data(),w.vbo.SizeBytes());
-    maint.stop(24);
-    
     //printf("VBO: %lf\n",maint(24));
     }
   
@@ -1926,27 +3218,8 @@ void scales_win_nodl(int win)
   glPushMatrix(); 
   glScaled(1/f.da_sx,1/f.da_sy,1);
   
-  line_shader.Bind();
-  
-  w.vbo.Bind();
-  
-  for(auto&i:attribpos)glEnableVertexAttribArray(i.second);
-  glVertexAttribPointer(attribpos["vertex"]  ,4,GL_FLOAT,0,sizeof(OneVertex),(void*)0 );
-  glVertexAttribPointer(attribpos["normal"]  ,3,GL_FLOAT,0,sizeof(OneVertex),(void*)16);
-  glVertexAttribPointer(attribpos["texcoord"],2,GL_FLOAT,0,sizeof(OneVertex),(void*)28);
-  
-  totallinepts+=pts.size();
-  
   glColor4d(R,G,B,1);
-  maint.start(21);// drawnum
-  glDrawArrays(GL_TRIANGLES,0,pts.size());
-  maint.stop(21);// drawnum
-  
-  for(auto&i:attribpos)glDisableVertexAttribArray(i.second);
-  
-  line_shader.Unbind();
-  
-  w.vbo.Unbind();
+  render_shaderlines(pts);
   
   //if(flag)printf("VA: %lf\n",maint(21));
   
@@ -1981,77 +3254,323 @@ void construct_timescale_nodl(double a,double b)
     
     for(auto&p:scale.points)draw_number2v(lines,p.label,scale.dec,f.textsize+p.size*4.0,(p.pos-a)/(b-a),-0.5/f.da_sy,1,0,0,f.textsize/12);
     
-   for(auto&line:scale.lines)
-      lines.push_back({(line.pos-a)/(b-a),1/f.da_sy,(line.pos-a)/(b-a),5*(line.size+1)/f.da_sy,0.8});
+   for(auto&line:scale.lines)
+      lines.push_back({(line.pos-a)/(b-a),1/f.da_sy,(line.pos-a)/(b-a),5*(line.size+1)/f.da_sy,0.8});
+    
+    lines.push_back({(scale.lines[0].pos-a)/(b-a),0.0,(scale.lines.back().pos-a)/(b-a),0.0,1});
+    
+    for(auto&line:scale.lines)
+      lines.push_back({(line.pos-a)/(b-a),0.0,(line.pos-a)/(b-a),1.0,(line.size+1)/60.0});
+    
+    for(size_t q1=0;q1<lines.size();q1++)
+      {
+      lines[q1][0]*=f.da_sx;
+      lines[q1][2]*=f.da_sx;
+      lines[q1][1]*=f.da_sy;
+      lines[q1][3]*=f.da_sy;
+      }
+    
+    pts.clear();
+    shaderlines(lines,pts);
+    
+    //printf("BEFORE: %s\n",gluErrorString(glGetError()));
+    
+    //printf("VBO: %lf\n",maint(24));
+    }
+    
+  
+  maint.start(20);// drawnum2
+  glMatrixMode(GL_MODELVIEW); 
+  glPushMatrix(); 
+  glScaled(1/f.da_sx,1/f.da_sy,1);
+  
+  glColor4dv(fg_col);
+  render_shaderlines(pts);
+  
+  //if(flag)printf("VA: %lf\n",maint(21));
+  
+  glPopMatrix(); 
+  
+  maint.stop(20);// drawnum2
+  }
+
+
+bool refresh_snapshot()
+  {
+  if(snapshot.epoch==graph_epoch)return false;
+  
+  snapshot.frames.clear();
+  for(auto&i:uframes)
+    {
+    FrameInfo& f=frames[i.second];
+    auto& fv=snapshot.frames.emplace_back();
+    fv.frame=&f;
+    for(auto&w:f.windows)
+      {
+      auto& wv=fv.windows.emplace_back();
+      wv.id=w;
+      wv.win=&windows[w];
+      for(auto&c:windows[w].channels)for(auto&seg:channels[c].data)wv.segments.push_back({&channels[c],&seg});
+      }
+    }
+  
+  snapshot.flat_windows.clear();
+  snapshot.flat_segments.clear();
+  for(auto&fv:snapshot.frames)for(auto&wv:fv.windows)
+    {
+    snapshot.flat_windows.push_back({&fv,&wv});
+    for(auto&v:wv.segments)snapshot.flat_segments.push_back({&fv,&wv,&v});
+    }
+  snapshot.epoch=graph_epoch;
+  return true;
+  }
+
+// visible range and decimated view of one segment, runs on the workers: no GL and no timers in here
+void prepare_segment(RenderSnapshot::SegmentRef& r)
+  {
+  auto& fv=*r.fv;
+  ChanInfo& ch=*r.v->chan;
+  ChanInfo::Segment& s=*r.v->seg;
+  if(!fv.frame->active || !ch.active)return;
+  
+  s.findtime(fv.starttime,fv.rendertime,ch.samplesperpixel,fv.frame->da_sx);
+  
+  if(ch.wintab!=r.wv->win->curtab)return;
+  if(s.size()==0 || s.time(0)>fv.rendertime || s.time(s.size()-1)<fv.starttime)return;
+  if(s.level==-1 && s.stride==1)return; // whole samples, appended to the segment VBO when drawn
+  s.build_view(fv.starttime);
+  }
+
+// the segments of all active frames in chunks, then per window what needs all of its segments:
+// the autorange and, for density windows, the heatmap in column bands
+void prepare_frames()
+  {
+  static constexpr size_t chunk=16;
+  auto& segs=snapshot.flat_segments;
+  workers.run((segs.size()+chunk-1)/chunk,[&](size_t q1)
+    {
+    for(size_t q2=q1*chunk;q2<std::min(segs.size(),(q1+1)*chunk);q2++)prepare_segment(segs[q2]);
+    });
+  
+  auto& wins=snapshot.flat_windows;
+  workers.run(wins.size(),[&](size_t q1)
+    {
+    if(wins[q1].fv->frame->active && wins[q1].wv->win->autorange)findminmax(*wins[q1].wv->win);
+    });
+  
+  int nbands=2*(workers.threads.size()+1);
+  std::vector < RenderSnapshot::WindowRef > dens;
+  for(auto&r:wins)if(r.fv->frame->active && r.wv->win->density)
+    {
+    FrameInfo& f=*r.fv->frame;
+    WindowInfo& win=*r.wv->win;
+    win.hw=std::max(1,(int)f.da_sx);
+    win.hh=std::max(1,(int)(f.da_sy*(win.pos_top-win.pos_bottom)));
+    win.hits.resize((size_t)win.hw*win.hh);
+    win.heatpx.resize((size_t)win.hw*win.hh*4);
+    win.bandmax.assign(nbands,0);
+    dens.push_back(r);
+    }
+  if(dens.size())
+    {
+    workers.run(dens.size()*nbands,[&](size_t q1)
+      {
+      auto& r=dens[q1/nbands];
+      rasterise_density(*r.wv,q1%nbands,nbands,r.fv->starttime,r.fv->timespan);
+      });
+    workers.run(dens.size()*nbands,[&](size_t q1){colour_density(*dens[q1/nbands].wv->win,q1%nbands,nbands);});
+    }
+  }
+
+bool density_drawn(const WindowInfo& win,const ChanInfo& ch)
+  {
+  return win.density && ch.active && ch.wintab==win.curtab && ch.style.style!=2 && ch.data2.data.empty();
+  }
+
+// band of nbands of the density columns of wv: each segment's polyline (its whole samples or the view
+// prepare_window built) touches one vertical run of rows per column, and every row of it counts once
+void rasterise_density(RenderSnapshot::WindowView& wv,int band,int nbands,double starttime,double timespan)
+  {
+  WindowInfo& win=*wv.win;
+  int W=win.hw,H=win.hh;
+  int x1=W*band/nbands,x2=W*(band+1)/nbands;
+  std::fill(win.hits.begin()+(size_t)x1*H,win.hits.begin()+(size_t)x2*H,0);
+  
+  double sx=W/timespan,sy=H/(win.top()-win.bottom()),bottom=win.bottom();
+  
+  for(auto&v:wv.segments)
+    {
+    ChanInfo::Segment& s=*v.seg;
+    if(!density_drawn(win,*v.chan) || s.size()==0 || s.c2<s.c1)continue;
+    
+    bool whole=s.level==-1 && s.stride==1;
+    size_t n=whole?s.c2-s.c1+1:s.vcache.size()/2;
+    auto px=[&](size_t i){return ((whole?s.time(s.c1+i):s.vastart+s.vcache[2*i])-starttime)*sx;};
+    auto py=[&](size_t i){return ((whole?s.value(s.c1+i):s.vcache[2*i+1])-bottom)*sy;};
     
-    lines.push_back({(scale.lines[0].pos-a)/(b-a),0.0,(scale.lines.back().pos-a)/(b-a),0.0,1});
+    int cc=-1;
+    double lo=0,hi=0;
+    auto flush=[&]()
+      {
+      if(cc<0 || hi<0 || lo>=H)return;
+      uint32_t* col=win.hits.data()+(size_t)cc*H;
+      int r1=lo<0?0:(int)lo,r2=hi>=H?H-1:(int)hi;
+      for(int r=r1;r<=r2;r++)col[r]++;
+      };
+    auto touch=[&](int c,double y1,double y2)
+      {
+      if(y1>y2)std::swap(y1,y2);
+      if(c!=cc){flush();cc=c;lo=y1;hi=y2;return;}
+      lo=std::min(lo,y1);
+      hi=std::max(hi,y2);
+      };
     
-    for(auto&line:scale.lines)
-      lines.push_back({(line.pos-a)/(b-a),0.0,(line.pos-a)/(b-a),1.0,(line.size+1)/60.0});
+    // the last vertex left of the band is where the first line into it starts
+    size_t a=0,b=n;
+    while(a<b){size_t m=(a+b)/2;if(px(m)<x1)a=m+1;else b=m;}
+    if(a)a--;
     
-    for(size_t q1=0;q1<lines.size();q1++)
+    if(n==1 && px(0)>=x1 && px(0)<x2)touch((int)px(0),py(0),py(0));
+    for(size_t i=a;i+1<n;i++)
       {
-      lines[q1][0]*=f.da_sx;
-      lines[q1][2]*=f.da_sx;
-      lines[q1][1]*=f.da_sy;
-      lines[q1][3]*=f.da_sy;
+      double xa=px(i),xb=px(i+1);
+      if(xa>=x2)break;
+      if(xb<xa)continue;
+      double ya=py(i),yb=py(i+1);
+      int ca=xa<x1?x1:(int)std::floor(xa),cb=xb>=x2?x2-1:(int)std::floor(xb);
+      for(int c=ca;c<=cb;c++)
+        {
+        double u1=xb>xa?(std::max(xa,(double)c  )-xa)/(xb-xa):0;
+        double u2=xb>xa?(std::min(xb,(double)c+1)-xa)/(xb-xa):1;
+        touch(c,ya+(yb-ya)*u1,ya+(yb-ya)*u2);
+        }
       }
-    
-    pts.clear();
-    shaderlines(lines,pts);
-    
-    //printf("BEFORE: %s\n",gluErrorString(glGetError()));
-    
-    maint.start(24);
-    f.vbo.Reinitialise(pangolin::GlArrayBuffer,pts.size(),GL_FLOAT,sizeof(pts[0])/sizeof(float),GL_DYNAMIC_DRAW);
-    f.vbo.Upload(pts.data(),f.vbo.SizeBytes());
-    maint.stop(24);
-    
-    //printf("VBO: %lf\n",maint(24));
+    flush();
     }
-    
-  
-  maint.start(20);// drawnum2
-  glMatrixMode(GL_MODELVIEW); 
-  glPushMatrix(); 
-  glScaled(1/f.da_sx,1/f.da_sy,1);
   
-  line_shader.Bind();
-  
-  //glBindBuffer(GL_ARRAY_BUFFER,f.vbo);
-  f.vbo.Bind();
+  uint32_t mx=0;
+  for(size_t q1=(size_t)x1*H;q1<(size_t)x2*H;q1++)mx=std::max(mx,win.hits[q1]);
+  win.bandmax[band]=mx;
+  }
+
+// same band in colour: the window colour on a log scale of the busiest pixel, brightening to white
+void colour_density(WindowInfo& win,int band,int nbands)
+  {
+  int W=win.hw,H=win.hh;
+  int x1=W*band/nbands,x2=W*(band+1)/nbands;
+  uint32_t mx=*std::max_element(win.bandmax.begin(),win.bandmax.end());
   
-  for(auto&i:attribpos)glEnableVertexAttribArray(i.second);
-  glVertexAttribPointer(attribpos["vertex"]  ,4,GL_FLOAT,0,sizeof(OneVertex),(void*)0);
-  glVertexAttribPointer(attribpos["normal"]  ,3,GL_FLOAT,0,sizeof(OneVertex),(void*)16);
-  glVertexAttribPointer(attribpos["texcoord"],2,GL_FLOAT,0,sizeof(OneVertex),(void*)28);
+  std::array < std::array < uint8_t, 4 >, 256 > lut;
+  for(int q1=0;q1<256;q1++)
+    {
+    double u=q1/255.0;
+    lut[q1]={(uint8_t)(255*(win.r+(1-win.r)*u*u)),(uint8_t)(255*(win.g+(1-win.g)*u*u)),
+             (uint8_t)(255*(win.b+(1-win.b)*u*u)),(uint8_t)(255*(0.2+0.8*u))};
+    }
   
-  totallinepts+=pts.size();
+  double norm=255/std::log1p(std::max(mx,1u));
+  for(int x=x1;x<x2;x++)
+    {
+    const uint32_t* col=win.hits.data()+(size_t)x*H;
+    for(int y=0;y<H;y++)
+      {
+      uint8_t* p=win.heatpx.data()+((size_t)y*W+x)*4;
+      if(!col[y]){p[0]=p[1]=p[2]=p[3]=0;continue;}
+      std::memcpy(p,lut[std::min(255,(int)(std::log1p(col[y])*norm))].data(),4);
+      }
+    }
+  }
+
+// keeps per vertices for every sample in [a,b) (counted like the pyramid) in the VBO of s, relative to
+// s.vastart: samples past the uploaded ones are appended, the buffer is rebuilt from a with twice the
+// room when it is full, when more of it lies before a than after it or when the origin drifted too far
+template<typename F>
+void sync_vbo(ChanInfo::Segment& s,pangolin::GlBuffer& vbo,size_t a,size_t b,int per,double span,F&& vertices)
+  {
+  if(b<=a)return;
+  size_t end=s.vfirst+s.vcount;
   
-  glColor4dv(fg_col);
-  maint.start(21);// drawnum
-  glDrawArrays(GL_TRIANGLES,0,pts.size());
-  maint.stop(21);// drawnum
+  bool rebuild=std::isnan(s.vastart) || !s.vwhole || a<s.vfirst || a>end
+    || a-s.vfirst>b-a || (b-s.vfirst)*per>vbo.num_elements
+    || std::fabs(s.time(b-1-s.evicted)-s.vastart)>64*span;
   
-  for(auto&i:attribpos)glDisableVertexAttribArray(i.second);
+  if(rebuild)
+    {
+    s.vwhole=true;
+    s.vfirst=end=a;
+    s.vcount=0;
+    s.vastart=s.time(a-s.evicted);
+    vbo.Reinitialise(pangolin::GlArrayBuffer,2*(b-a)*per,GL_FLOAT,2,GL_DYNAMIC_DRAW);
+    }
+  if(b<=end)return;
   
-  line_shader.Unbind();
-  f.vbo.Unbind();
+  std::vector<float> va;
+  va.reserve((b-end)*per*2);
+  for(size_t q1=end;q1<b;q1++)vertices(q1-s.evicted,va);
+  vbo.Upload(va.data(),va.size()*sizeof(float),(end-s.vfirst)*per*2*sizeof(float));
+  s.vcount=b-s.vfirst;
+  }
+
+// n ranges of the vertices starting at byte base of bo, drawn in state st: style 2 as bars, otherwise
+// a line strip (unless fully transparent) and, for style 1, points through the point shader. Vertices
+// are t,x float pairs in st's colours, or BatchVertex when coloured, each carrying its own colours.
+void render_styled(const DrawState& st,GLuint bo,GLintptr base,const GLint* first,const GLsizei* count,int n,bool coloured=false)
+  {
+  GLsizei stride=coloured?sizeof(BatchVertex):0;
+  auto colour=[&](size_t field,double alpha)
+    {
+    if(coloured)glColorPointer(4,GL_UNSIGNED_BYTE,stride,(void*)(base+field));
+    else glColor4d(st.r,st.g,st.b,alpha);
+    };
   
-  //if(flag)printf("VA: %lf\n",maint(21));
+  glBindBuffer(GL_ARRAY_BUFFER,bo);
+  glVertexPointer(2,GL_FLOAT,stride,(void*)base);
+  glEnableClientState(GL_VERTEX_ARRAY);
+  if(coloured)glEnableClientState(GL_COLOR_ARRAY);
   
-  glPopMatrix(); 
+  if(st.style==2)
+    {
+    colour(offsetof(BatchVertex,fill),st.a);
+    glMultiDrawArrays(GL_QUADS,first,count,n);
+    }
+  if(st.lines())
+    {
+    glLineWidth(st.linewidth);
+    colour(offsetof(BatchVertex,line),st.alpha);
+    glMultiDrawArrays(GL_LINE_STRIP,first,count,n);
+    //printf("%d alpha: %lf\n",c,alpha);
+    }
+  if(st.style==1)
+    {
+    glPointSize(st.pointsize);
+    colour(offsetof(BatchVertex,fill),st.a);
+    if(shaderuse)glUseProgram(point_shader.ProgramId());else glUseProgram(0);
+    glMultiDrawArrays(GL_POINTS,first,count,n);
+    glUseProgram(0);
+    }
   
-  maint.stop(20);// drawnum2
+  if(coloured)glDisableClientState(GL_COLOR_ARRAY);
+  glDisableClientState(GL_VERTEX_ARRAY);
+  glBindBuffer(GL_ARRAY_BUFFER,0);
   }
 
+// the packed run goes to the stream ring and out in one multi-draw per primitive
+void flush_batch()
+  {
+  if(batch.count.empty())return;
+  maint.start(37);// data2gpu
+  GLintptr base=stream.push(batch.va.data(),batch.va.size()*sizeof(BatchVertex));
+  render_styled(batch.state,stream.bo,base,batch.first.data(),batch.count.data(),batch.count.size(),true);
+  maint.stop(37);// data2gpu
+  batch.va.clear();
+  batch.first.clear();
+  batch.count.clear();
+  }
 
-void render1(FrameInfo*curf)
+// layout, wheel motion and time range of a frame, before any frame is prepared or drawn
+void frame_view(RenderSnapshot::FrameView& fv)
   {
-  //TIME(2,curf->name);
-  
-  cf=curf;
-  auto&f=*cf;
+  auto&f=*fv.frame;
   
   f.lsizex=sizex*(f.x2-f.x1);
   f.lsizey=sizey*(f.y2-f.y1);
@@ -2062,6 +3581,54 @@ void render1(FrameInfo*curf)
   f.da_yc=f.lsizey/((1.0+f.mt+f.mb)/f.mb)+f.y1*sizey;
   f.da_uyc=f.lsizey/((1.0+f.mt+f.mb)/f.mt)+f.y1*sizey;
   
+  if(f.mouse.inside)
+    {
+    double delta=0;
+    if(fw_motion.t(0)<fw_motion.motion_time) { delta-=0.1*f.timespan*fw_motion.t(4)/fw_motion.motion_time; fw_motion.t.start(4); }
+    if(fw_motion.t(1)<fw_motion.motion_time) { delta+=0.1*f.timespan*fw_motion.t(5)/fw_motion.motion_time; fw_motion.t.start(5); }
+    f.endtime+=delta;
+    //printf("%lf %lf\n",f.endtime,delta);
+    }
+  
+  double rendertime;
+  if(f.mode==0||f.mode==3)rendertime=f.endtime;
+  else if(f.mode==1||f.mode==2)rendertime=f.lasttime;
+  else {printf("Invalid frame mode\n");rendertime=f.lasttime;}
+  
+  if(f.mode==1||f.mode==2)f.endtime=rendertime;
+  
+  double timespan=f.timespan;
+  if(timespan<1e-6)timespan=1e-6;
+  
+  fv.rendertime=rendertime;
+  fv.timespan=timespan;
+  fv.starttime=rendertime-timespan;
+  
+  for(auto&wv:fv.windows)
+    {
+    WindowInfo& win=*wv.win;
+    
+    if(win.mouse.inside)
+      {
+      double delta=0;
+      double size=win.top()-win.bottom();
+      if(fw_motion.t(2)<fw_motion.motion_time) { delta-=0.1*size*fw_motion.t(6)/fw_motion.motion_time; fw_motion.t.start(6); }
+      if(fw_motion.t(3)<fw_motion.motion_time) { delta+=0.1*size*fw_motion.t(7)/fw_motion.motion_time; fw_motion.t.start(7); }
+      win.bottom()+=delta;
+      win.top   ()+=delta;
+      win.reconfigured=true;
+      //printf("%lf %lf\n",f.endtime,delta);
+      }
+    }
+  }
+
+void render1(RenderSnapshot::FrameView& fv)
+  {
+  //TIME(2,curf->name);
+  
+  cf=fv.frame;
+  auto&f=*cf;
+  
   
   
   glMatrixMode (GL_MODELVIEW);
@@ -2114,33 +3681,15 @@ void render1(FrameInfo*curf)
       }
     
     glColor3d(im.r,im.g,im.b);
-    glBegin(GL_QUADS);
-    for(int q1=0;q1<4;q1++){glTexCoord2d(e1[q1*2+0],e1[q1*2+1]);glVertex3d(e1[8+q1*2+0],e1[8+q1*2+1],0);}
-    glEnd();
+    render_text_quad(e1.data(),e1.data()+8);
     
     glDisable(GL_TEXTURE_2D);
     } 
   
   
-  if(f.mouse.inside)
-    {
-    double delta=0;
-    if(fw_motion.t(0)<fw_motion.motion_time) { delta-=0.1*f.timespan*fw_motion.t(4)/fw_motion.motion_time; fw_motion.t.start(4); }
-    if(fw_motion.t(1)<fw_motion.motion_time) { delta+=0.1*f.timespan*fw_motion.t(5)/fw_motion.motion_time; fw_motion.t.start(5); }
-    f.endtime+=delta;
-    //printf("%lf %lf\n",f.endtime,delta);
-    }
-  
-  double rendertime;
-  if(f.mode==0||f.mode==3)rendertime=f.endtime;
-  else if(f.mode==1||f.mode==2)rendertime=f.lasttime;
-  else {printf("Invalid frame mode\n");rendertime=f.lasttime;}
-  
-  if(f.mode==1||f.mode==2)f.endtime=rendertime;
-  
-  double timespan=f.timespan;
-  if(timespan<1e-6)timespan=1e-6;
-  double starttime=rendertime-timespan;
+  double rendertime=fv.rendertime;
+  double timespan=fv.timespan;
+  double starttime=fv.starttime;
   
   //printf("%lf %lf %lf\n",rendertime,timespan,starttime);
   
@@ -2154,32 +3703,13 @@ void render1(FrameInfo*curf)
   if(displaylists)construct_timescale_nodl(endt-timespan,endt);
   maint.stop(34);// mscale
   
-  for(auto&w:f.windows)
+  
+  for(auto&wv:fv.windows)
     {
     glMatrixMode(GL_MODELVIEW);
     
-    WindowInfo& win=windows[w];
-    
-    if(win.mouse.inside)
-      {
-      double delta=0;
-      double size=win.top()-win.bottom();
-      if(fw_motion.t(2)<fw_motion.motion_time) { delta-=0.1*size*fw_motion.t(6)/fw_motion.motion_time; fw_motion.t.start(6); }
-      if(fw_motion.t(3)<fw_motion.motion_time) { delta+=0.1*size*fw_motion.t(7)/fw_motion.motion_time; fw_motion.t.start(7); }
-      win.bottom()+=delta;
-      win.top   ()+=delta;
-      win.reconfigured=true;
-      //printf("%lf %lf\n",f.endtime,delta);
-      }
-    
-    
-    maint.start(39);// mnmxft
-    for(auto&c:win.channels)if(channels[c].active)
-      for(auto&s:channels[c].data)
-        s.findtime(starttime,rendertime,channels[c].samplesperpixel,f.da_sx);
-
-    if(win.autorange)findminmax(win);
-    maint.stop(39);// mnmxft
+    int w=wv.id;
+    WindowInfo& win=*wv.win;
     
     if(win.reconfigured)
       {
@@ -2259,19 +3789,14 @@ void render1(FrameInfo*curf)
         
         glColor3d(1-0.5*(1-channels[c].style.r),1-0.5*(1-channels[c].style.g),1-0.5*(1-channels[c].style.b));
         
-        glBegin(GL_QUADS);
-        
         //glTexCoord2d(0,0); glVertex3d(0.98-xx2+xx1,yy1*(1-0)+yy2*0,0);
         //glTexCoord2d(1,0); glVertex3d(0.98-xx2+xx2,yy1*(1-0)+yy2*0,0);
         //glTexCoord2d(1,1); glVertex3d(0.98-xx2+xx2,yy1*(1-1)+yy2*1,0);
         //glTexCoord2d(0,1); glVertex3d(0.98-xx2+xx1,yy1*(1-1)+yy2*1,0);
          
-        glTexCoord2d(0,0); glVertex2d(xx1,yy1*(1-0)+yy2*0);
-        glTexCoord2d(1,0); glVertex2d(xx2,yy1*(1-0)+yy2*0);
-        glTexCoord2d(1,1); glVertex2d(xx2,yy1*(1-1)+yy2*1);
-        glTexCoord2d(0,1); glVertex2d(xx1,yy1*(1-1)+yy2*1);
-        
-        glEnd();
+        double tex[8]={0,0,1,0,1,1,0,1};
+        double pos[8]={xx1,yy1,xx2,yy1,xx2,yy2,xx1,yy2};
+        render_text_quad(tex,pos);
         break;
         }
       
@@ -2298,24 +3823,10 @@ void render1(FrameInfo*curf)
         
         glColor3d(channels[c].style.r,channels[c].style.g,channels[c].style.b);
         
-        glBegin(GL_QUADS);
-        
-        if(f.right_label)
-          {
-          glTexCoord2d(0,0); glVertex2d(0.98-xx2+xx1,yy1*(1-0)+yy2*0);
-          glTexCoord2d(1,0); glVertex2d(0.98-xx2+xx2,yy1*(1-0)+yy2*0);
-          glTexCoord2d(1,1); glVertex2d(0.98-xx2+xx2,yy1*(1-1)+yy2*1);
-          glTexCoord2d(0,1); glVertex2d(0.98-xx2+xx1,yy1*(1-1)+yy2*1);
-          }
-        else
-          {
-          glTexCoord2d(0,0); glVertex2d(xx1,yy1*(1-0)+yy2*0);
-          glTexCoord2d(1,0); glVertex2d(xx2,yy1*(1-0)+yy2*0);
-          glTexCoord2d(1,1); glVertex2d(xx2,yy1*(1-1)+yy2*1);
-          glTexCoord2d(0,1); glVertex2d(xx1,yy1*(1-1)+yy2*1);
-          }
-        
-        glEnd();
+        double sx=f.right_label?0.98-xx2:0;
+        double tex[8]={0,0,1,0,1,1,0,1};
+        double pos[8]={sx+xx1,yy1,sx+xx2,yy1,sx+xx2,yy2,sx+xx1,yy2};
+        render_text_quad(tex,pos);
         if(auto c1=glGetError();c1)printf("ERROR: LINE %d %u\n",__LINE__,c1);
         
         maint.stop(36);// font2
@@ -2333,22 +3844,36 @@ void render1(FrameInfo*curf)
     
       
     
+    if(win.density)
+      {
+      if(win.heat.width!=win.hw || win.heat.height!=win.hh)
+        win.heat.Reinitialise(win.hw,win.hh,GL_RGBA8,false,0,GL_RGBA,GL_UNSIGNED_BYTE,win.heatpx.data());
+      else win.heat.Upload(win.heatpx.data(),0,0,win.hw,win.hh,GL_RGBA,GL_UNSIGNED_BYTE);
+      
+      glEnable(GL_TEXTURE_2D);
+      win.heat.Bind();
+      glColor4d(1,1,1,1);
+      double tex[8]={0,0,1,0,1,1,0,1};
+      double pos[8]={0,win.bottom(),timespan,win.bottom(),timespan,win.top(),0,win.top()};
+      render_text_quad(tex,pos);
+      glDisable(GL_TEXTURE_2D);
+      }
+    
     //TIME(1);
     //if(0)
-    for(auto&c:win.channels)for(auto&s:channels[c].data)
+    for(auto&v:wv.segments)
       {
       //TIME(2);
-      if(!channels[c].active)continue;
-      if(channels[c].wintab!=win.curtab)continue;
-      if(s.data.size()==0)continue;
-      if(s.data[0].t>rendertime)continue;
-      if(s.data.back().t<starttime)continue;
+      ChanInfo::Segment& s=*v.seg;
+      if(!v.chan->active)continue;
+      if(density_drawn(win,*v.chan))continue;
+      if(v.chan->wintab!=win.curtab)continue;
+      if(s.size()==0)continue;
+      if(s.time(0)>rendertime)continue;
+      if(s.time(s.size()-1)<starttime)continue;
       
-      const ChanInfo& chan=channels[c];
-      ChanInfo& chan_m=channels[c];
-      
-      if(vbos.count(&s)==0)vbos[&s]=std::make_unique<pangolin::GlBuffer>(pangolin::GlArrayBuffer,0,GL_FLOAT,2,GL_DYNAMIC_DRAW);
-      pangolin::GlBuffer& vbo=*vbos[&s];
+      const ChanInfo& chan=*v.chan;
+      ChanInfo& chan_m=*v.chan;
       
       int c1=s.c1;
       int c2=s.c2;
@@ -2357,126 +3882,142 @@ void render1(FrameInfo*curf)
       int toprint=s.toprint;
       
       
-      std::vector<float> va;
-      
-      
-      if(chan.style.style==2)
-        {
-        
-        
-        if(starttime!=s.vastart || vbo.num_elements==0)
-          {
-          s.vastart=starttime;
-          
-          for(int q1=0;q1<(int)s.data.size()-1;q1++)
-            {
-            va.push_back(-starttime + s.data[q1].t);   va.push_back(0.0);
-            va.push_back(-starttime + s.data[q1+1].t); va.push_back(0.0);
-            va.push_back(-starttime + s.data[q1+1].t); va.push_back(s.data[q1].x);
-            va.push_back(-starttime + s.data[q1].t);   va.push_back(s.data[q1].x);
-            }
-          
-          vbo.Reinitialise(pangolin::GlArrayBuffer,va.size()/2,GL_FLOAT,2,GL_DYNAMIC_DRAW,(unsigned char*)va.data());
-          
-          }
-        
-        
-        glColor4d(chan.style.r,chan.style.g,chan.style.b,chan.style.a);
-        pangolin::RenderVbo(vbo,GL_QUADS);
-        
-        
-        continue;
-        }
-      
-      //glColor3d(chan.style.r,chan.style.g,chan.style.b);
-      
-      
-      
-      maint.start(38);// prepdata
-      if(starttime!=s.vastart || toprint!=(int)vbo.num_elements)
-        {
-        //TIME(1);
-        //printf("%s %d\n",chan.name.c_str(),toprint);
-        s.vastart=starttime;
-        va.reserve(toprint*2);
-        
-        double*src=(double*)(&(s.data[c1]));
-        
-        for(int q2=0,q3=0;q2<=c2-c1;q2+=stride,q3++)
-          {
-          va.push_back(src[q2*2]-starttime);
-          va.push_back(src[q2*2+1]+0);
-          }
-        
-        
-        vbo.Reinitialise(pangolin::GlArrayBuffer,va.size()/2,GL_FLOAT,2,GL_DYNAMIC_DRAW,(unsigned char*)va.data());
-        //vbo.Resize(va.size()/2);
-        //vbo.Upload(va.data(),vbo.SizeBytes());
-        }
-      maint.stop(38);// prepdata
-      
-      //printf("%25s: %d\n",chan.name.c_str(),toprint);
-      
-      
-      
-      double alpha=1;
-      
-      
-      
+      DrawState st;
+      st.style=chan.style.style;
+      st.r=chan.style.r;
+      st.g=chan.style.g;
+      st.b=chan.style.b;
+      st.a=chan.style.a;
+      st.alpha=chan.style.a;
       if(chan.style.style==0)
         {
-        alpha=chan.style.a;
-        glLineWidth(std::min(10.0,chan.style.width));
-        glPointSize(std::min(10.0,chan.style.width));
+        st.linewidth=std::min(10.0,chan.style.width);
+        st.pointsize=std::min(10.0,chan.style.width);
         }
       if(chan.style.style==1)
         {
-        glLineWidth(chan.style.width/1.5);
-        glPointSize(chan.style.width);
-        alpha=s.alpha*chan.style.a;
-        if(!chan.showshadow)alpha=0;
+        st.linewidth=chan.style.width/1.5;
+        st.pointsize=chan.style.width;
+        st.alpha=s.alpha*chan.style.a;
+        if(!chan.showshadow)st.alpha=0;
         }
       if(chan.style.style==1 && chanselect==&s && chan.showshadow)
         {
-        glLineWidth(chan.style.width*1.5+2);
-        glPointSize(chan.style.width*1.5+3);
-        alpha=0.9*chan.style.a;
+        st.linewidth=chan.style.width*1.5+2;
+        st.pointsize=chan.style.width*1.5+3;
+        st.alpha=0.9*chan.style.a;
         //printf("%s\n",chan.label.c_str());
         }
-        
-      totalprint+=toprint;
       
-      maint.start(37);// data2gpu
-      if(chan.style.style==0||alpha!=0)
+      if(chan.style.style!=2)totalprint+=toprint;
+      
+      maint.start(38);// prepdata
+      // every visible sample, as one vertex or as one bar from it to the next sample,
+      // or else the decimated view prepare_window built
+      int per=chan.style.style==2?4:1;
+      bool whole=s.level==-1 && stride==1;
+      size_t a=s.evicted+c1,b=s.evicted+(per==4?std::min(c2+1,s.size()-1):c2+1);
+      if(b<a)b=a;
+      size_t vnum=whole?(b-a)*per:s.vcache.size()/2;
+      auto vertices=[&](int q1,std::vector<float>& va,double origin)
+        {
+        if(per==1)
+          {
+          va.push_back(s.time(q1)-origin);
+          va.push_back(s.value(q1));
+          return;
+          }
+        va.push_back(s.time(q1)  -origin); va.push_back(0.0);
+        va.push_back(s.time(q1+1)-origin); va.push_back(0.0);
+        va.push_back(s.time(q1+1)-origin); va.push_back(s.value(q1));
+        va.push_back(s.time(q1)  -origin); va.push_back(s.value(q1));
+        };
+      
+      if(vnum==0)maint.stop(38);// prepdata
+      else if(vnum<=(whole?tiny_vertices:batch_vertices))
         {
-        glColor4d(chan.style.r,chan.style.g,chan.style.b,alpha);
-        pangolin::RenderVbo(vbo,GL_LINE_STRIP);
-        //printf("%d alpha: %lf\n",c,alpha);
+        // packed relative to starttime with its colours into the window's current run
+        if(!st.batches_with(batch.state))flush_batch();
+        batch.state=st;
+        
+        auto byte=[](double v){return (uint8_t)std::lround(std::clamp(v,0.0,1.0)*255);};
+        BatchVertex bv;
+        bv.line[0]=bv.fill[0]=byte(st.r);
+        bv.line[1]=bv.fill[1]=byte(st.g);
+        bv.line[2]=bv.fill[2]=byte(st.b);
+        bv.line[3]=byte(st.alpha);
+        bv.fill[3]=byte(st.a);
+        
+        batch.first.push_back(batch.va.size());
+        batch.count.push_back(vnum);
+        if(whole)
+          {
+          std::vector<float>& va=batch.floats;
+          va.clear();
+          for(size_t q1=a;q1<b;q1++)vertices(q1-s.evicted,va,starttime);
+          for(size_t q1=0;q1<va.size();q1+=2){bv.t=va[q1];bv.x=va[q1+1];batch.va.push_back(bv);}
+          }
+        else for(size_t q1=0;q1<s.vcache.size();q1+=2)
+          {
+          bv.t=s.vcache[q1]+(s.vastart-starttime);
+          bv.x=s.vcache[q1+1];
+          batch.va.push_back(bv);
+          }
+        maint.stop(38);// prepdata
         }
-      if(chan.style.style==1)
+      else
         {
-        glColor4d(chan.style.r,chan.style.g,chan.style.b,chan.style.a);
+        flush_batch();
         
-        if(shaderuse)glUseProgram(point_shader.ProgramId());else glUseProgram(0);
-        pangolin::RenderVbo(vbo,GL_POINTS);
-        glUseProgram(0);
+        // whole samples stay in the segment VBO and only new ones are appended, views are streamed
+        GLuint vsrc;
+        GLint vfrom=0;
+        GLintptr vbase=0;
+        if(whole)
+          {
+          if(!buffers.owns(s.vbo))s.vwhole=false;
+          pangolin::GlBuffer& vbo=buffers.get(s.vbo);
+          sync_vbo(s,vbo,a,b,per,timespan,[&](int q1,std::vector<float>& va){vertices(q1,va,s.vastart);});
+          vsrc=vbo.bo;
+          vfrom=(a-s.vfirst)*per;
+          }
+        else
+          {
+          vsrc=stream.bo;
+          vbase=stream.push(s.vcache.data(),s.vcache.size()*sizeof(float));
+          }
+        maint.stop(38);// prepdata
         
+        // vertices are relative to s.vastart, the view offset only goes into the matrix
+        maint.start(37);// data2gpu
+        glPushMatrix();
+        glTranslated(s.vastart-starttime,0.0,0.0);
+        GLsizei vcount=vnum;
+        render_styled(st,vsrc,vbase,&vfrom,&vcount,1);
+        glPopMatrix();
+        maint.stop(37);// data2gpu
         }
-      maint.stop(37);// data2gpu
       
       
       if(chan.data2.data.size())
         {
+        flush_batch();
         auto& d=chan_m.data2;
         auto& d1=chan_m.data[0];
         
         if(d.fixtex)//if(0)
           {
           //TIME(1);
+          // everything new goes into the unpack buffer at once, then one sub-image per texture it spans
+          // tiles get their storage first: with the unpack buffer bound glTexImage2D would read from it
+          size_t from=(size_t)d.totalfill*d.h*3;
+          size_t columns=d.data.size()/3/d.h;
+          while(d.tex.size()*d.maxtexture<columns)d.tex.emplace_back(d.h,d.maxtexture,GL_RGB32F,false,0,GL_RGB,GL_FLOAT);
+          
+          d.pbo.stage(d.data.data()+from,(d.data.size()-from)*sizeof(float));
           while(d.totalfill*d.h*3<(int)d.data.size())
             {
             int texfill=d.totalfill%d.maxtexture;
-            if(texfill==0)d.tex.emplace_back(d.maxtexture,d.h,GL_RGB32F,false,0,GL_RGB,GL_FLOAT);
             
             size_t len=d.data.size()-d.totalfill*d.h*3;
             len=std::min(len,(size_t)d.maxtexture*d.h*3-texfill*3*d.h);
@@ -2484,11 +4025,10 @@ void render1(FrameInfo*curf)
             size_t width=len/3/d.h;
             size_t addr=d.totalfill*d.h*3;
             //printf("%zu   %zu %d   %zu %d %zu  %zu  %d %d\n",len,  w,d.h ,d.tex.size(),d.maxtexture,d.data.size(),addr,texfill,d.totalfill);
-            for(size_t q2=0;q2<width;q2++)d.tex.back().Upload(d.data.data()+addr+d.h*3*q2,texfill+q2,0,1,d.h,GL_RGB,GL_FLOAT);
-            //d.tex.emplace_back(1,1,GL_RGB32F,false,0,GL_RGB,GL_FLOAT,d.data.data()+addr);
-            //pangolin::PixelFormatFromString
+            d.tex[d.totalfill/d.maxtexture].Upload((void*)((addr-from)*sizeof(float)),0,texfill,d.h,width,GL_RGB,GL_FLOAT);
             d.totalfill+=width;
             }
+          glBindBuffer(GL_PIXEL_UNPACK_BUFFER,0);
           //chan_m.data2.gltex.Load(chan.data2.image);
           d.fixtex=false;
           }
@@ -2503,22 +4043,21 @@ void render1(FrameInfo*curf)
           glEnable(GL_TEXTURE_2D);
           glBindTexture(GL_TEXTURE_2D,d.tex[q1].tid);
           glColor3d(1,1,1);
-          glBegin(GL_QUADS);
           //float t1=q1*d.maxtexture*d.dt;
           //float t2=t1+d.dt*w*d.maxtexture;
-          float t1=d1.data[0].t + q1*d.dt*d.maxtexture;  
+          float t1=d1.time(0) + q1*d.dt*d.maxtexture;  
           float t2=          t1 + ww*d.dt*d.maxtexture;
           //printf("==tex== %zu %lf %lf   %lf    %d\n",q1,t1,t2,w,d.totalfill-(int)q1*d.maxtexture);
-          glTexCoord2d(0,0); glVertex2f(t1-starttime,d.x1);
-          glTexCoord2d(ww,0); glVertex2f(t2-starttime,d.x1);
-          glTexCoord2d(ww,1); glVertex2f(t2-starttime,d.x2);
-          glTexCoord2d(0,1); glVertex2f(t1-starttime,d.x2);
-          glEnd();
+          // transposed: s runs along the value axis, t along time
+          double tex[8]={0,0,0,ww,1,ww,1,0};
+          double pos[8]={t1-starttime,d.x1,t2-starttime,d.x1,t2-starttime,d.x2,t1-starttime,d.x2};
+          render_text_quad(tex,pos);
           glDisable(GL_TEXTURE_2D);
           }
         }
       
       }
+    flush_batch();
     
     glPopMatrix();
     
@@ -2557,7 +4096,21 @@ void render()
   //if(iconified!=iconify)if(iconify==0)glfwRestoreWindow(window);
   
   
+  // everything that mutates the graph runs here, the rest of the frame only reads it
   configdata.lock();
+  maint.start(15);
+  
+  maint.start(14);
+  apply_packets();
+  maint.stop(14);
+  
+  flush_input_event_queue();
+  findlasttimes();
+  apply_retention();
+  refresh_snapshot();
+  
+  maint.stop(15);
+  configdata.unlock();
   
   if(!point_shader.Valid())doshaders();
   
@@ -2591,6 +4144,8 @@ void render()
   glClearColor(bg_col[0],bg_col[1],bg_col[2],bg_col[3]);
   glClear(GL_COLOR_BUFFER_BIT);
   
+  stream.begin_frame();
+  
   maint.start(12);
   
   maint.stop(10);
@@ -2614,12 +4169,13 @@ void render()
   
   
   
-  findlasttimes();
-  
-  
   //glGetQueryObjectuiv(query[0], GL_QUERY_RESULT, &queryres[0]);
   //glBeginQuery(GL_TIME_ELAPSED, query[0]);
-  for(auto&i:uframes)if(frames[i.second].active)render1(&frames[i.second]);
+  for(auto&fv:snapshot.frames)if(fv.frame->active)frame_view(fv);
+  maint.start(39);// mnmxft
+  prepare_frames();
+  maint.stop(39);// mnmxft
+  for(auto&fv:snapshot.frames)if(fv.frame->active)render1(fv);
   //glEndQuery(GL_TIME_ELAPSED);
   
   
@@ -2636,6 +4192,8 @@ void render()
   if(displaylists)draw_number2(num_frames,0,8,32.0/sizex,(8+2)/2.0/sizey,0,1,1,1);
   fps+=1.0;if(maint(9)>1.0){num_frames=fps;fps=0.0;maint.start(9);}
   
+  stream.end_frame();
+  
   maint.stop(12);
   
   
@@ -2762,6 +4320,8 @@ void render()
     {
     maint.start(8);
     printf("prepare: %8.3lf    ",maint(10)*1000);  
+    printf("apply: %8.3lf    ",maint.acc(14)*1000);  
+    printf("locked: %8.3lf    ",maint.acc(15)*1000);  
     printf("render: %8.3lf    ",maint.acc(12)*1000);   
     //printf("swap: %8.3lf    ",maint(13)*1000); 
     printf("font: %8.3lf   ",maint.acc(35)*1000.0);
@@ -2781,8 +4341,6 @@ void render()
   totallinepts=0;
   
   
-  configdata.unlock();
-  
   
   maint.start(13);  
   // TO CHANGE TOPANGO
@@ -2791,15 +4349,6 @@ void render()
   
   
   
-  {
-  std::lock_guard lg2(configdata);
-  //TIME(1);
-  std::unordered_set<ChanInfo::Segment*> ptrs;
-  for(auto&i:uframes)for(auto&w:frames[i.second].windows)for(auto&c:windows[w].channels)for(auto&s:channels[c].data)ptrs.insert(&s);
-  std::vector<ChanInfo::Segment*> todelete;
-  for(auto&e1:vbos)if(ptrs.count(e1.first)==0)todelete.push_back(e1.first);
-  for(auto&e1:todelete)vbos.erase(e1);
-  }
   
   
   
@@ -2828,6 +4377,7 @@ struct MouseEventSW
   };
 
 
+// called from flush_input_event_queue, inside the locked part of render()
 void mouse_event(const MouseEventSW& event)
   {
   int scroll=event.scroll;
@@ -2870,8 +4420,6 @@ void mouse_event(const MouseEventSW& event)
     printf("%d %d %d %d\n",screenshot.x,screenshot.y,screenshot.sizex,screenshot.sizey);
     }
   
-  configdata.lock();
-  
   findlasttimes();
   
   double ratio=7.0/8.0;
@@ -3144,15 +4692,12 @@ void mouse_event(const MouseEventSW& event)
     
     }
   
-  configdata.unlock();
-  
   } 
 
 
 void key_callback(int key, int action, int mods)
   {
   using namespace pangolin;
-  configdata.lock();
   
   if(action==1)if(key=='s'){shaderuse=1-shaderuse;printf("New shaderuse: %d\n",shaderuse);}
   if(action==1)if(key=='f'){displayfonts=1-displayfonts;printf("New displayfonts: %d\n",displayfonts);}
@@ -3216,8 +4761,6 @@ void key_callback(int key, int action, int mods)
           frames[if2].timespan=f.timespan;
           frames[if2].mode=f.mode;
           }
-  
-  configdata.unlock();
   }
 
 
@@ -3236,6 +4779,8 @@ struct InputHandler : public pangolin::Handler
   
   int key_mods=0;
   
+  // events are queued and handled by the render thread at the start of the next frame
+  void post(const MouseEventSW& e) { inst->add_input_event([inst=inst,e](){ inst->mouse_event(e); }); }
   
   void Keyboard(View&, unsigned char key, int x, int y, bool pressed) override
     {
@@ -3246,7 +4791,7 @@ struct InputHandler : public pangolin::Handler
     if(key==pangolin::PANGO_SPECIAL + pangolin::PANGO_KEY_CTRL_L ){if(pressed)key_mods|=CTRL_MOD; else key_mods&=~CTRL_MOD ;}
     if(key==pangolin::PANGO_SPECIAL + pangolin::PANGO_KEY_SHIFT_L){if(pressed)key_mods|=SHIFT_MOD;else key_mods&=~SHIFT_MOD;}
     
-    inst->key_callback(key,pressed,key_mods);
+    inst->add_input_event([inst=inst,key,pressed,mods=key_mods](){ inst->key_callback(key,pressed,mods); });
     }
   void Mouse(View&, pangolin::MouseButton button, int x, int y, bool pressed, int button_state) override
     {
@@ -3269,14 +4814,14 @@ struct InputHandler : public pangolin::Handler
       if(button==1)if(mouse_timer(button)<0.3)
         {
         mevent.type=SW_GDK_2BUTTON_PRESS;
-        inst->mouse_event(mevent);
+        post(mevent);
         }
       mouse_timer.start(button);
       }
     
     if(mevent.type==SW_GDK_SCROLL && !pressed)return;
     
-    inst->mouse_event(mevent);
+    post(mevent);
     
     }
   void MouseMotion(View&, int x, int y, int button_state) override
@@ -3285,7 +4830,7 @@ struct InputHandler : public pangolin::Handler
     mevent.x=x;
     mevent.y=y;
     mevent.type=SW_GDK_MOTION_NOTIFY;
-    inst->mouse_event(mevent);
+    post(mevent);
     }
   void PassiveMouseMotion(View&, int x, int y, int button_state) override
     {
@@ -3293,7 +4838,7 @@ struct InputHandler : public pangolin::Handler
     mevent.x=x;
     mevent.y=y;
     mevent.type=SW_GDK_MOTION_NOTIFY;
-    inst->mouse_event(mevent);
+    post(mevent);
     }
   void MouseBoundary(View&, int x, int y, int button_state, bool enter) override
     {
@@ -3302,7 +4847,7 @@ struct InputHandler : public pangolin::Handler
     mevent.x=x;
     mevent.y=y;
     mevent.type = enter ? SW_GDK_ENTER_NOTIFY : SW_GDK_LEAVE_NOTIFY;
-    inst->mouse_event(mevent);
+    post(mevent);
     }
   void Special(View&, pangolin::InputSpecial inType, float x, float y, float p1, float p2, float p3, float p4, int button_state) override
     {
@@ -3321,6 +4866,7 @@ void start(const std::string& name)
   if(iname!="")shmname+="_"+iname;
   
   comm=std::make_unique<CommHandler>(shmname);
+  comm->receiver=std::thread([this](){ listen_main(); });
   
   pangolin::CreateWindowAndBind(name,1200,1200,{{"default_font_size","15"}});
   pango_window=pangolin::GetBoundWindow();
@@ -3350,7 +4896,11 @@ Instance(const std::string& name="") : iname(name)
   start(name);
   }
 
-~Instance() { }
+~Instance()
+  {
+  stopped=true;
+  if(comm && comm->receiver.joinable())comm->receiver.join();
+  }
 
 
 static void test_render(const std::string& name="")
@@ -3452,8 +5002,6 @@ int main(int argc, const char** argv)
     {
     glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
     
-    instance.listen_main();
-    
     // TO CHANGE FIX PANGO
     //if(usevsync)glfwSwapInterval(1);
     //else glfwSwapInterval(0);